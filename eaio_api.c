@@ -6,295 +6,2056 @@
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 
 #include "array.h"
 #include "etask.h"
 #include "eaio_logger.h"
 #include "eaio_api.h"
+#include "eaio_engine.h"
+#include "eaio_filter.h"
+#include "eaio_numa.h"
 
 #define EAIO_INFLIGHT_MAX 512
+#define EAIO_ADAPT_START 16
+#define EAIO_DRR_QUANTUM (64 << 10)
+#define NSEC_PER_SEC 1000000000ULL
+#define EAIO_MERGE_SEGS 64
+#define EAIO_MERGE_BYTES (1 << 20)
+#define EAIO_TASK_SLAB (256UL << 10)
+#define EAIO_PROMOTE_LEFT 4	/*a timed request still waiting with 1/4 of its timeout left is promoted*/
+
+_Static_assert(EAIO_STATS_PRIO_MAX == EAIO_PRIO_MAX, "eaio_qstats has one entry per class");
+
+#define EAIO_EPOLL_EVENTS 64
+
+/*epoll key of a queue fd, the low bits tell which of its fds fired*/
+enum {
+	EAIO_KEY_IN = 0,
+	EAIO_KEY_OUT = 1,
+	EAIO_KEY_TIMER = 2,
+};
+#define KEY_FROM_QUEUE(q, kind) ((uintptr_t)(q) | (kind))
+#define QUEUE_FROM_KEY(k) ((struct eaio_queue *)((k) & ~(uintptr_t)3))
+#define KEY_KIND(k) ((int)((k) & 3))
 
 #define DATA_FROM_TASK(t) ((void *)(t))
 #define TASK_FROM_DATA(d) ((struct eaio_task *)(d))
 
+/*shared by the tasks of one blocking eaio_context_rdwt() or eaio_context_rdwt_batch() call*/
+struct eaio_waiter {
+	int efd;	/*-1 when the caller sleeps on wait*/
+	struct ewait wait;
+	int pending;
+};
+
+/*one of the waiter's requests is done*/
+static void eaio_waiter_wake(struct eaio_waiter *waiter)
+{
+	if (__atomic_sub_fetch(&waiter->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (waiter->efd >= 0) {
+			eventfd_xsend(waiter->efd, 1);
+		} else {
+			ewait_wake(&waiter->wait);
+		}
+	}
+}
+
 struct eaio_task {
+	struct mpsc_node inode;
 	struct list_node node;
-	int efd;
+	struct list_node onode;	/*on qaio->ordered from drain to completion*/
 
 	int result;
 	int qnum;
 	int prio;
+	size_t bytes;
+	bool barrier;	/*EAIO_OPT_BARRIER*/
+	bool inflight;	/*handed to the engine, alone or merged*/
+	bool merged;	/*inflight inside a carrier*/
+	uint64_t qstamp;	/*enqueue time*/
+	uint64_t stamp;	/*submit time*/
+
+	/*eaio_context_submit_timed() and friends*/
+	uint64_t id;	/*tag of the request, 0 for none*/
+	uint64_t deadline;	/*relative until enqueued, then absolute; 0 for none*/
+	uint64_t expire;	/*when it is dispatched ahead of the policy, from deadline; 0 for never*/
+	bool promoted;	/*moved to the head of its class for that*/
+	struct list_node tnode;	/*on qaio->timed while it has a deadline*/
+	int error;	/*-ETIMEDOUT or -ECANCELED once aborted, reported whatever the device says*/
+	uint64_t victim;	/*set on the cancel request for the task with this id*/
+
+	struct eaio_merge *merge;	/*set when this task only carries merged ones*/
+	struct eaio_context *around;	/*an async write past the filters, they drop its range once done*/
+
+	/*blocking callers wait on waiter, eaio_context_submit() ones get done()*/
+	struct eaio_waiter *waiter;
+	eaio_done_fcb_t done;
+	void *usr;
 
 	struct iocb iocb;
 };
 
-static int eaio_queue_init(struct eaio_queue *qaio)
+/*a mapping of tasks, the free ones are chained through their first word*/
+struct eaio_tslab {
+	struct eaio_tslab *next;
+	size_t len;
+};
+
+#define EAIO_TASK_STRIDE (((sizeof(struct eaio_task) + 63) / 64) * 64)
+
+/*a new slab, its pages faulted in on the queue's node before any task is handed out*/
+static struct eaio_task *eaio_task_grow(struct eaio_queue *qaio)
 {
-	qaio->i_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-	if (qaio->i_efd < 0) {
-		return -1;
+	struct eaio_tslab *slab = mmap(NULL, EAIO_TASK_SLAB, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	qaio->o_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-	if (qaio->o_efd < 0) {
-		close(qaio->i_efd);
-		return -1;
+	if (qaio->node >= 0) {
+		eaio_numa_bind(slab, EAIO_TASK_SLAB, qaio->node);
 	}
+	memset(slab, 0, EAIO_TASK_SLAB);
+	slab->len = EAIO_TASK_SLAB;
 
-	memset(&qaio->context, 0, sizeof(qaio->context));	/*不能少*/
-	int ret = io_setup(EAIO_INFLIGHT_MAX, &qaio->context);
-	if (ret < 0) {
-		close(qaio->i_efd);
-		close(qaio->o_efd);
-		return -1;
+	/*the first one is the caller's, the others go on the free list*/
+	char *first = (char *)slab + EAIO_TASK_STRIDE;
+	int nr = (EAIO_TASK_SLAB - EAIO_TASK_STRIDE) / EAIO_TASK_STRIDE;
+	pthread_spin_lock(&qaio->tlock);
+	for (int i = nr - 1; i > 0; i--) {
+		struct eaio_task *task = (struct eaio_task *)(first + i * EAIO_TASK_STRIDE);
+		*(struct eaio_task **)task = qaio->tfree;
+		qaio->tfree = task;
 	}
+	slab->next = qaio->tslabs;
+	qaio->tslabs = slab;
+	pthread_spin_unlock(&qaio->tlock);
+	return (struct eaio_task *)first;
+}
 
-	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
-		INIT_LIST_HEAD(&qaio->waiting[i]);
+/*a zeroed task of qaio, NULL with errno set*/
+static struct eaio_task *eaio_task_alloc(struct eaio_queue *qaio)
+{
+	pthread_spin_lock(&qaio->tlock);
+	struct eaio_task *task = qaio->tfree;
+	if (task) {
+		qaio->tfree = *(struct eaio_task **)task;
 	}
-	pthread_mutex_init(&qaio->mutex, NULL);
+	pthread_spin_unlock(&qaio->tlock);
 
-	qaio->inflight = 0;
+	if (!task) {
+		return eaio_task_grow(qaio);
+	}
+	memset(task, 0, sizeof(*task));
+	return task;
+}
+
+static void eaio_task_free(struct eaio_queue *qaio, struct eaio_task *task)
+{
+	pthread_spin_lock(&qaio->tlock);
+	*(struct eaio_task **)task = qaio->tfree;
+	qaio->tfree = task;
+	pthread_spin_unlock(&qaio->tlock);
+}
+
+static int libaio_setup(struct eaio_queue *qaio, int depth)
+{
+	memset(&qaio->context, 0, sizeof(qaio->context));	/*不能少*/
+	int ret = io_setup(depth, &qaio->context);
+	if (ret < 0) {
+		eaio_printf(LOG_ERR, "io_setup failed: %s", strerror(-ret));
+		return -1;
+	}
 	return 0;
 }
 
-static int eaio_queue_free(struct eaio_queue *qaio)
+static void libaio_destroy(struct eaio_queue *qaio)
 {
-	close(qaio->i_efd);
-	close(qaio->o_efd);
 	io_destroy(qaio->context);
-	pthread_mutex_destroy(&qaio->mutex);
-	return 0;
 }
 
-static bool eaio_queue_have_waiting(struct eaio_queue *qaio)
+static int libaio_submit(struct eaio_queue *qaio, struct iocb *iocbp[], int nr)
 {
-	bool have = false;
-	pthread_mutex_lock(&qaio->mutex);
-	for (int i = 0; i < EAIO_PRIO_MAX; i ++) {
-		if (!list_empty(&qaio->waiting[i])) {
-			have = true;
-			break;
-		}
+	for (int i = 0; i < nr; i++) {
+		io_set_eventfd(iocbp[i], qaio->o_efd);
 	}
-	pthread_mutex_unlock(&qaio->mutex);
-	return have;
+	return io_submit(qaio->context, nr, iocbp);
 }
 
-static long eaio_queue_getevents(struct eaio_queue *qaio, long need)
+/*
+ * io_setup() hands back the user address of the completion ring as the context,
+ * the kernel appends events at tail and whoever reaps them moves head.
+ */
+struct eaio_aio_ring {
+	unsigned id;
+	unsigned nr;	/*slots, head and tail wrap at it*/
+	unsigned head;
+	unsigned tail;
+	unsigned magic;
+	unsigned compat_features;
+	unsigned incompat_features;
+	unsigned header_length;
+	struct io_event events[0];
+};
+
+#define EAIO_AIO_RING_MAGIC 0xa10a10a1
+
+static int libaio_getevents(struct eaio_queue *qaio, struct io_event *events, int nr)
 {
-	struct io_event events[need];
-	//memset(events, 0, sizeof(struct io_event) * need);
+	struct eaio_aio_ring *ring = (struct eaio_aio_ring *)qaio->context;
 
-	struct timespec ts = {
-		.tv_sec = 0,
-		.tv_nsec = 0,
-	};
+	/*off the ring only with eaio_attr.spin_us, an unknown layout goes through the syscall*/
+	if (!qaio->ring || (ring->magic != EAIO_AIO_RING_MAGIC) || ring->incompat_features) {
+		struct timespec ts = {
+			.tv_sec = 0,
+			.tv_nsec = 0,
+		};
 
-	int nr_events = io_getevents(qaio->context, 1, need, events, &ts);
+		return io_getevents(qaio->context, 0, nr, events, &ts);
+	}
 
-	for (int i = 0; i < nr_events; i++) {
-		struct io_event *ev = &events[i];
-		struct eaio_task *task = TASK_FROM_DATA(ev->data);
+	/*only the owning executor reaps, so head is ours to move*/
+	unsigned head = ring->head;
+	unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	int done = 0;
+	for (; (head != tail) && (done < nr); done++) {
+		events[done] = ring->events[head];
+		head = (head + 1 < ring->nr) ? (head + 1) : 0;
+	}
+	if (done) {
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+	return done;
+}
 
-		task->result = ev->res;
-		eventfd_xsend(task->efd, 1);
-		qaio->inflight --;
+/*most files refuse with -EINVAL, kernels since 4.18 say -EINPROGRESS and complete through the ring*/
+static int libaio_cancel(struct eaio_queue *qaio, struct iocb *iocb, struct io_event *ev)
+{
+	int ret = io_cancel(qaio->context, iocb, ev);
+	if (ret == 0) {
+		return 1;
 	}
-	return nr_events;
+	return (ret == -EINPROGRESS) ? 0 : ret;
 }
 
-static int eaio_queue_try_inflight_and_submit(struct eaio_queue *qaio)
+const struct eaio_engine_ops eaio_engine_libaio = {
+	.name = "libaio",
+	.setup = libaio_setup,
+	.destroy = libaio_destroy,
+	.submit = libaio_submit,
+	.getevents = libaio_getevents,
+	.cancel = libaio_cancel,
+};
+
+/*one vectored iocb standing for several adjacent tasks*/
+struct eaio_merge {
+	struct eaio_task carrier;
+	int nr;
+	struct eaio_task *tasks[EAIO_MERGE_SEGS];
+	struct iovec iov[EAIO_MERGE_SEGS];
+	struct eaio_merge *next;	/*free list of the queue*/
+};
+
+/*
+ * Class selection policy of a queue.
+ * pick() is only called while some class has waiting tasks and returns that class,
+ * charge() accounts the task taken from it.
+ */
+struct eaio_sched_ops {
+	const char *name;
+	int (*pick)(struct eaio_queue *qaio);
+	void (*charge)(struct eaio_queue *qaio, int prio, struct eaio_task *task);
+};
+
+static void eaio_tbucket_init(struct eaio_tbucket *tb, uint64_t rate)
 {
-	struct iocb *iocbp[EAIO_INFLIGHT_MAX];
+	tb->rate = rate;
+	tb->burst = (rate / 10) ? (rate / 10) : 1;
+	tb->tokens = tb->burst;
+	tb->stamp = eaio_clock_ns();
+}
 
-	int done = 0;
-	int todo = EAIO_INFLIGHT_MAX - qaio->inflight;
-	pthread_mutex_lock(&qaio->mutex);
-	for (int i = 0; todo && (i < EAIO_PRIO_MAX); i ++) {
-		while (todo && !list_empty(&qaio->waiting[i])) {
-			struct eaio_task *task = list_first_entry(&qaio->waiting[i], struct eaio_task, node);
+static void eaio_tbucket_refill(struct eaio_tbucket *tb, uint64_t now)
+{
+	if (!tb->rate) {
+		return;
+	}
+	uint64_t dt = now - tb->stamp;
+	if (dt > NSEC_PER_SEC) {
+		dt = NSEC_PER_SEC;
+	}
+	uint64_t add = (unsigned __int128)tb->rate * dt / NSEC_PER_SEC;
+	if (!add) {
+		return;
+	}
+	tb->tokens += add;
+	if (tb->tokens >= tb->burst) {
+		tb->tokens = tb->burst;
+		tb->stamp = now;
+	} else {
+		/*keep the remainder for the next refill*/
+		tb->stamp += (unsigned __int128)add * NSEC_PER_SEC / tb->rate;
+	}
+}
 
-			io_set_eventfd(&task->iocb, qaio->o_efd);
-			iocbp[done] = &task->iocb;
+static inline bool eaio_tbucket_ok(struct eaio_tbucket *tb)
+{
+	return !tb->rate || (tb->tokens > 0);
+}
 
-			list_del(&task->node);
-			done ++;
-			todo --;
-		}
+/*ns until eaio_tbucket_ok() turns true*/
+static uint64_t eaio_tbucket_wait(struct eaio_tbucket *tb)
+{
+	if (eaio_tbucket_ok(tb)) {
+		return 0;
 	}
-	pthread_mutex_unlock(&qaio->mutex);
+	return (unsigned __int128)(1 - tb->tokens) * NSEC_PER_SEC / tb->rate;
+}
 
-	if (done) {
-		int first = 0;
-		do {
-			int ret = io_submit(qaio->context, done - first, &iocbp[first]);
-			if (ret < 0) {
-				eaio_printf(LOG_INFO, "io %d submited ret %d: %s", done - first, ret, strerror(-ret));
-				struct eaio_task *task = TASK_FROM_DATA(iocbp[first]->data);
-				task->result = ret;
-				eventfd_xsend(task->efd, 1);
-				first ++;
-			} else {
-				//eaio_printf(LOG_DEBUG, "io %d submited ret %d", done - first, ret);
-				qaio->inflight += ret;
-				first += ret;
-			}
-		} while (first < done);
+static void eaio_limiter_init(struct eaio_limiter *lim, const struct eaio_limit *limit)
+{
+	eaio_tbucket_init(&lim->iops, limit ? limit->iops : 0);
+	eaio_tbucket_init(&lim->bps, limit ? limit->bps : 0);
+}
+
+static void eaio_limiter_refill(struct eaio_limiter *lim, uint64_t now)
+{
+	eaio_tbucket_refill(&lim->iops, now);
+	eaio_tbucket_refill(&lim->bps, now);
+}
+
+static inline bool eaio_limiter_ok(struct eaio_limiter *lim)
+{
+	return eaio_tbucket_ok(&lim->iops) && eaio_tbucket_ok(&lim->bps);
+}
+
+static void eaio_limiter_take(struct eaio_limiter *lim, size_t bytes)
+{
+	if (lim->iops.rate) {
+		lim->iops.tokens -= 1;
+	}
+	if (lim->bps.rate) {
+		lim->bps.tokens -= bytes;
 	}
+}
 
-	return done;
+static uint64_t eaio_limiter_wait(struct eaio_limiter *lim)
+{
+	uint64_t w1 = eaio_tbucket_wait(&lim->iops);
+	uint64_t w2 = eaio_tbucket_wait(&lim->bps);
+
+	return (w1 > w2) ? w1 : w2;
 }
 
-int eaio_context_init(struct eaio_context *aio_ctx, int qmax)
+static inline bool eaio_task_is_write(const struct eaio_task *task)
 {
-	if (qmax <= 0) {
-		return -1;
+	switch (task->iocb.aio_lio_opcode) {
+		case IO_CMD_PWRITE:
+		case IO_CMD_PWRITEV:
+		case IO_CMD_FSYNC:
+		case IO_CMD_FDSYNC:
+			return true;
+		default:
+			return false;
 	}
-	aio_ctx->qslot = calloc(qmax, sizeof(struct eaio_queue));
-	aio_ctx->qcnts = qmax;
+}
 
-	int idx = 0;
-	for (; idx < qmax; idx++) {
-		struct eaio_queue *qaio = &aio_ctx->qslot[idx];
-		int ret = eaio_queue_init(qaio);
-		if (ret < 0) {
-			for (int i = 0; i < idx; i++) {
-				eaio_queue_free(&aio_ctx->qslot[i]);
-			}
-			free(aio_ctx->qslot);
-			aio_ctx->qslot = NULL;
-			aio_ctx->qcnts = 0;
-			return -1;
+/*a barrier waits for every write or sync queued before it on the same fd*/
+static bool eaio_queue_barrier_blocked(struct eaio_queue *qaio, struct eaio_task *task)
+{
+	struct eaio_task *prev;
+
+	list_for_each_entry(prev, &qaio->ordered, onode) {
+		if (prev == task) {
+			break;
+		}
+		if ((prev->iocb.aio_fildes == task->iocb.aio_fildes) && eaio_task_is_write(prev)) {
+			return true;
 		}
 	}
-	return 0;
+	return false;
 }
 
-int eaio_context_exit(struct eaio_context *aio_ctx)
+/*the first waiting task of a class, NULL if the class is empty, throttled or behind a barrier*/
+static struct eaio_task *eaio_queue_head(struct eaio_queue *qaio, int prio)
 {
-	for (int i = 0; i < aio_ctx->qcnts; i++) {
-		struct eaio_queue *qaio = &aio_ctx->qslot[i];
-		eaio_queue_free(qaio);
+	if (list_empty(&qaio->waiting[prio]) || !eaio_limiter_ok(&qaio->plimit[prio])) {
+		return NULL;
 	}
-	free(aio_ctx->qslot);
-	aio_ctx->qslot = NULL;
-	aio_ctx->qcnts = 0;
-	return 0;
+	struct eaio_task *task = list_first_entry(&qaio->waiting[prio], struct eaio_task, node);
+	if (task->barrier && eaio_queue_barrier_blocked(qaio, task)) {
+		return NULL;
+	}
+	return task;
 }
 
+static bool eaio_queue_ready(struct eaio_queue *qaio)
+{
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		if (eaio_queue_head(qaio, i)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int strict_pick(struct eaio_queue *qaio)
+{
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		if (eaio_queue_head(qaio, i)) {
+			return i;
+		}
+	}
+	return -1;
+}
 
-static int efd_cmp(const void *efd1, const void *efd2)
+static void strict_charge(struct eaio_queue *qaio, int prio, struct eaio_task *task)
 {
-	return bcmp(efd1, efd2, sizeof(int));
 }
 
-int eaio_context_exec(struct eaio_context *aio_ctx)
+static const struct eaio_sched_ops eaio_sched_strict = {
+	.name = "strict",
+	.pick = strict_pick,
+	.charge = strict_charge,
+};
+
+/*a class gets its quantum once per visit and is served while its deficit covers the head*/
+static int drr_pick(struct eaio_queue *qaio)
 {
-	int efds[aio_ctx->qcnts * 2];
-	for (int i = 0; i < aio_ctx->qcnts; i++) {
-		struct eaio_queue *qaio = &aio_ctx->qslot[i];
-		efds[i*2 + 0] = qaio->i_efd;
-		efds[i*2 + 1] = qaio->o_efd;
-	}
-
-	int evts = eventfd_xwait(efds, aio_ctx->qcnts * 2, -1);
-	assert(evts > 0);
-
-	xqsort(efds, evts, efd_cmp);
-	for (int j = 0; j < aio_ctx->qcnts; j++) {
-		bool follow = false;
-		struct eaio_queue *qaio = &aio_ctx->qslot[j];
-		if (xbsearch(&qaio->o_efd, efds, evts, efd_cmp)) {
-			eventfd_t cnt = 0;
-			int ret = eventfd_xrecv(qaio->o_efd, &cnt);
-			assert(ret == 0);
-			if (cnt > 0) {
-				follow = true;
-				int get = eaio_queue_getevents(qaio, cnt);
-				assert(get == cnt);
+	while (1) {
+		int c = qaio->drr_cur;
+		struct eaio_task *task = eaio_queue_head(qaio, c);
+
+		if (task) {
+			if (qaio->drr_fresh) {
+				qaio->deficit[c] += qaio->quantum[c];
+				qaio->drr_fresh = false;
 			}
-		}
-		if (xbsearch(&qaio->i_efd, efds, evts, efd_cmp)) {
-			eventfd_t cnt = 0;
-			int ret = eventfd_xrecv(qaio->i_efd, &cnt);
-			assert(ret == 0);
-			if (cnt > 0) {
-				follow = true;
+			if (qaio->deficit[c] >= (int64_t)task->bytes) {
+				return c;
 			}
+		} else {
+			qaio->deficit[c] = 0;
+		}
+		qaio->drr_cur = (c + 1) % EAIO_PRIO_MAX;
+		qaio->drr_fresh = true;
+	}
+}
+
+static void drr_charge(struct eaio_queue *qaio, int prio, struct eaio_task *task)
+{
+	qaio->deficit[prio] -= task->bytes;
+}
+
+static const struct eaio_sched_ops eaio_sched_drr = {
+	.name = "drr",
+	.pick = drr_pick,
+	.charge = drr_charge,
+};
+
+/*the class whose head is past its deadline the longest, or -1*/
+static int eaio_queue_expired(struct eaio_queue *qaio, uint64_t now)
+{
+	int prio = -1;
+	uint64_t oldest = now;
+
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		struct eaio_task *task = eaio_queue_head(qaio, i);
+		if (!task) {
+			continue;
 		}
-		if (follow) {
-			do {
-				eaio_queue_try_inflight_and_submit(qaio);
-			} while ((qaio->inflight != EAIO_INFLIGHT_MAX) && eaio_queue_have_waiting(qaio));
+		/*the class deadline or the request's own, whichever comes first*/
+		uint64_t expire = task->expire;
+		if (qaio->expire_ns[i] && (!expire || (task->qstamp + qaio->expire_ns[i] < expire))) {
+			expire = task->qstamp + qaio->expire_ns[i];
+		}
+		if (expire && (expire <= oldest)) {
+			oldest = expire;
+			prio = i;
 		}
 	}
-	return 0;
+	return prio;
 }
 
-static void _default_watch_fcb(int efd, void *usr)
+/*
+ * Move the timed requests close to their deadline to the head of their class,
+ * where eaio_queue_expired() sees them. Barriers wait their turn, at the head
+ * they could only hold the class up.
+ */
+static void eaio_queue_promote(struct eaio_queue *qaio, uint64_t now)
 {
-	eventfd_t val = 0;
-	eventfd_xrecv(efd, &val);
+	struct eaio_task *task;
+
+	list_for_each_entry(task, &qaio->timed, tnode) {
+		if (task->inflight || task->promoted || task->barrier || task->error || (task->expire > now)) {
+			continue;
+		}
+		list_move(&task->node, &qaio->waiting[task->prio]);
+		task->promoted = true;
+	}
 }
 
-int eaio_context_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
-		int fd, void *buf, size_t count, off_t offset,
-		eaio_watch_fcb_t fcb, void *usr)
+static void eaio_queue_sched_init(struct eaio_queue *qaio, const struct eaio_qattr *qattr)
+{
+	qaio->sched = (qattr && (qattr->sched == EAIO_SCHED_DRR)) ? &eaio_sched_drr : &eaio_sched_strict;
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		int weight = (qattr && (qattr->weight[i] > 0)) ? qattr->weight[i] : (EAIO_PRIO_MAX - i);
+
+		qaio->quantum[i] = (int64_t)weight * EAIO_DRR_QUANTUM;
+		qaio->deficit[i] = 0;
+		qaio->expire_ns[i] = (qattr && (qattr->expire[i] > 0)) ? (uint64_t)qattr->expire[i] * 1000 : 0;
+		eaio_limiter_init(&qaio->plimit[i], qattr ? &qattr->plimit[i] : NULL);
+	}
+	eaio_limiter_init(&qaio->limit, qattr ? &qattr->limit : NULL);
+	qaio->drr_cur = 0;
+	qaio->drr_fresh = true;
+}
+
+static int eaio_queue_init(struct eaio_queue *qaio, const struct eaio_engine_ops *ops,
+		const struct eaio_qattr *qattr)
 {
-	struct eaio_task task = {};
+	qaio->i_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (qaio->i_efd < 0) {
+		return -1;
+	}
+	qaio->o_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (qaio->o_efd < 0) {
+		close(qaio->i_efd);
+		return -1;
+	}
+	qaio->t_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (qaio->t_fd < 0) {
+		close(qaio->i_efd);
+		close(qaio->o_efd);
+		return -1;
+	}
 
-	INIT_LIST_NODE(&task.node);
-	int efd = eventfd(0, 0);
-	if (efd < 0) {
-		return efd;
+	qaio->depth = (qattr && (qattr->depth > 0)) ? qattr->depth : EAIO_INFLIGHT_MAX;
+	qaio->allowed = qaio->depth;
+	qaio->target_ns = 0;
+	if (qattr && (qattr->target_lat > 0)) {
+		qaio->target_ns = (uint64_t)qattr->target_lat * 1000;
+		qaio->allowed = (qaio->depth < EAIO_ADAPT_START) ? qaio->depth : EAIO_ADAPT_START;
+	}
+	qaio->lat_sum = 0;
+	qaio->lat_cnt = 0;
+	qaio->limited = false;
+	eaio_queue_sched_init(qaio, qattr);
+	qaio->merge = qattr && qattr->merge;
+	qaio->mfree = NULL;
+	qaio->tfree = NULL;
+	qaio->tslabs = NULL;
+	memset(&qaio->stats, 0, sizeof(qaio->stats));
+	qaio->trace = NULL;
+	if (qattr && (qattr->trace_size > 0)) {
+		qaio->trace = eaio_trace_create(qattr->trace_size);
+		if (!qaio->trace) {
+			close(qaio->i_efd);
+			close(qaio->o_efd);
+			close(qaio->t_fd);
+			return -1;
+		}
 	}
-	task.efd = efd;
 
-	task.result = 0;
-	task.qnum = qnum % aio_ctx->qcnts;
-	task.prio = prio % EAIO_PRIO_MAX;
+	/*depth has no upper bound, so the dispatch arrays are not on the executor's stack*/
+	qaio->dispatch = malloc(qaio->depth * sizeof(struct eaio_task *));
+	qaio->iocbp = malloc(qaio->depth * sizeof(struct iocb *));
+	qaio->ops = ops;
+	int ret = (qaio->dispatch && qaio->iocbp) ? ops->setup(qaio, qaio->depth) : -1;
+	if (ret < 0) {
+		free(qaio->dispatch);
+		free(qaio->iocbp);
+		eaio_trace_free(qaio->trace);
+		close(qaio->i_efd);
+		close(qaio->o_efd);
+		close(qaio->t_fd);
+		return -1;
+	}
 
-	switch (opt) {
-		case EAIO_OPT_PWRITE:
-			io_prep_pwrite(&task.iocb, fd, buf, count, offset);
-			break;
-		case EAIO_OPT_PREAD:
-			io_prep_pread(&task.iocb, fd, buf, count, offset);
-			break;
-		case EAIO_OPT_POLL:
-			io_prep_poll(&task.iocb, fd, *(int *)buf);
-			break;
-		default:
-			assert(0);
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		INIT_LIST_HEAD(&qaio->waiting[i]);
 	}
-	task.iocb.data = DATA_FROM_TASK(&task);
+	INIT_LIST_HEAD(&qaio->ordered);
+	INIT_LIST_HEAD(&qaio->timed);
+	INIT_MPSC_QUEUE(&qaio->inbox);
+	pthread_spin_init(&qaio->tlock, PTHREAD_PROCESS_PRIVATE);
+	qaio->t_armed = 0;
+	qaio->next_id = 0;
+	qaio->node = (qattr && qattr->numa) ? qattr->node : -1;
+
+	qaio->inflight = 0;
+	return 0;
+}
 
-	struct eaio_queue *qaio = &aio_ctx->qslot[task.qnum];
+/*edge triggered: every eventfd_xsend() is one wakeup and the counter is drained each time*/
+static int eaio_queue_watch(struct eaio_queue *qaio, int epfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+	};
 
-retry:
-	pthread_mutex_lock(&qaio->mutex);
-	list_add_tail(&task.node, &qaio->waiting[task.prio]);
-	pthread_mutex_unlock(&qaio->mutex);
+	ev.data.ptr = (void *)KEY_FROM_QUEUE(qaio, EAIO_KEY_IN);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, qaio->i_efd, &ev) < 0) {
+		return -1;
+	}
+	ev.data.ptr = (void *)KEY_FROM_QUEUE(qaio, EAIO_KEY_OUT);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, qaio->o_efd, &ev) < 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, qaio->i_efd, NULL);
+		return -1;
+	}
+	ev.data.ptr = (void *)KEY_FROM_QUEUE(qaio, EAIO_KEY_TIMER);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, qaio->t_fd, &ev) < 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, qaio->i_efd, NULL);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, qaio->o_efd, NULL);
+		return -1;
+	}
+	return 0;
+}
 
+static int eaio_queue_free(struct eaio_queue *qaio)
+{
+	close(qaio->i_efd);
+	close(qaio->o_efd);
+	close(qaio->t_fd);
+	qaio->ops->destroy(qaio);
+	while (qaio->mfree) {
+		struct eaio_merge *merge = qaio->mfree;
+		qaio->mfree = merge->next;
+		free(merge);
+	}
+	while (qaio->tslabs) {
+		struct eaio_tslab *slab = qaio->tslabs;
+		qaio->tslabs = slab->next;
+		munmap(slab, slab->len);
+	}
+	qaio->tfree = NULL;
+	pthread_spin_destroy(&qaio->tlock);
+	eaio_trace_free(qaio->trace);
+	qaio->trace = NULL;
+	free(qaio->dispatch);
+	free(qaio->iocbp);
+	qaio->dispatch = NULL;
+	qaio->iocbp = NULL;
+	return 0;
+}
 
-	eventfd_xsend(qaio->i_efd, 1);
-	if (fcb) {
-		fcb(task.efd, usr);
-	} else {
-		_default_watch_fcb(task.efd, usr);
+static inline void eaio_task_trace(struct eaio_queue *qaio, struct eaio_task *task,
+		uint16_t type, uint64_t now, int result)
+{
+	if (qaio->trace) {
+		eaio_trace_record(qaio->trace, type, now, task, task->iocb.aio_fildes, task->iocb.u.c.offset,
+				task->bytes, result, task->prio, task->iocb.aio_lio_opcode);
 	}
+}
 
-	if (task.result < 0) {
-		errno = -task.result;
-		task.result = -1;
+/*lock free for the callers, all tasks are announced with one wakeup*/
+static void eaio_queue_enqueue(struct eaio_queue *qaio, struct eaio_task *tasks, int nr)
+{
+	uint64_t now = eaio_clock_ns();
 
-		if ((errno == EINTR) || (errno == EAGAIN)) {
-			goto retry;
+	for (int i = 0; i < nr; i++) {
+		tasks[i].qstamp = now;
+		if (tasks[i].deadline) {
+			tasks[i].expire = now + tasks[i].deadline - tasks[i].deadline / EAIO_PROMOTE_LEFT;
+			tasks[i].deadline += now;
 		}
-		fprintf(stderr, "failed: %s\n", strerror(errno));
+		eaio_task_trace(qaio, &tasks[i], EAIO_TRACE_ENQUEUE, now, 0);
+		mpsc_push(&qaio->inbox, &tasks[i].inode);
 	}
 
-	close(task.efd);
+	eventfd_xsend(qaio->i_efd, 1);
+}
+
+static void eaio_queue_cancel(struct eaio_queue *qaio, uint64_t id);
 
-	return task.result;
+/*executor side: move what the callers pushed onto the waiting lists*/
+static void eaio_queue_drain(struct eaio_queue *qaio)
+{
+	struct mpsc_node *inode;
+	uint64_t now = qaio->trace ? eaio_clock_ns() : 0;
+
+	while ((inode = mpsc_pop(&qaio->inbox)) != NULL) {
+		struct eaio_task *task = mpsc_entry(inode, struct eaio_task, inode);
+
+		if (task->victim) {
+			/*behind its victim in the inbox, so the victim is on ordered unless done*/
+			eaio_queue_cancel(qaio, task->victim);
+			eaio_task_free(qaio, task);
+			continue;
+		}
+		eaio_task_trace(qaio, task, EAIO_TRACE_DRAIN, now, 0);
+		list_add_tail(&task->node, &qaio->waiting[task->prio]);
+		list_add_tail(&task->onode, &qaio->ordered);
+		if (task->deadline) {
+			list_add_tail(&task->tnode, &qaio->timed);
+		}
+		eaio_stat_add(&qaio->stats.queued, 1);
+	}
+}
+
+/*
+ * Hand the result back to the owner of the task.
+ * Blocking callers are woken once their last task is done, async ones get their
+ * callback and the task is released here; EINTR/EAGAIN are queued again.
+ */
+static void eaio_task_done(struct eaio_queue *qaio, struct eaio_task *task, int result, uint64_t now)
+{
+	task->inflight = false;
+	task->merged = false;
+	if (task->error) {
+		result = task->error;
+	}
+	eaio_task_trace(qaio, task, EAIO_TRACE_COMPLETE, now, result);
+	if ((result == -EINTR) || (result == -EAGAIN)) {
+		list_add_tail(&task->node, &qaio->waiting[task->prio]);
+		eaio_stat_add(&qaio->stats.retries, 1);
+		eaio_stat_add(&qaio->stats.queued, 1);
+		return;
+	}
+	list_del(&task->onode);
+	if (list_linked(&task->tnode)) {
+		list_del(&task->tnode);
+	}
+
+	struct eaio_cstats *cs = &qaio->stats.cls[task->prio];
+	eaio_stat_add(&qaio->stats.completed, 1);
+	eaio_stat_add(&cs->completed, 1);
+	if (result < 0) {
+		eaio_stat_add(&qaio->stats.errors, 1);
+		eaio_stat_add(&cs->errors, 1);
+	} else {
+		eaio_stat_add(&qaio->stats.bytes, result);
+		eaio_stat_add(&cs->bytes, result);
+	}
+	eaio_hist_add(&cs->lat, now - task->qstamp);
+
+	if (!task->done) {
+		task->result = result;
+		eaio_waiter_wake(task->waiter);
+		return;
+	}
+
+	if (task->around) {
+		eaio_context_invalidate(task->around, task->iocb.aio_fildes, task->iocb.u.c.offset,
+				task->bytes ? task->bytes : 1);
+	}
+	task->done(result, task->usr);
+	eaio_task_free(qaio, task);
+}
+
+static bool eaio_queue_pending(struct eaio_queue *qaio)
+{
+	for (int i = 0; i < EAIO_PRIO_MAX; i ++) {
+		if (!list_empty(&qaio->waiting[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool eaio_queue_have_waiting(struct eaio_queue *qaio)
+{
+	eaio_queue_drain(qaio);
+	return eaio_queue_pending(qaio);
+}
+
+/*
+ * Once per window of allowed completions compare the mean latency with the target:
+ * above it the cap shrinks by a quarter, below it the cap grows by an eighth,
+ * but only if the cap actually held requests back during the window.
+ */
+static void eaio_queue_adapt(struct eaio_queue *qaio, uint64_t lat)
+{
+	qaio->lat_sum += lat;
+	if (++qaio->lat_cnt < qaio->allowed) {
+		return;
+	}
+
+	uint64_t mean = qaio->lat_sum / qaio->lat_cnt;
+	int allowed = qaio->allowed;
+	if (mean > qaio->target_ns) {
+		allowed -= allowed / 4;
+		if (allowed < 1) {
+			allowed = 1;
+		}
+	} else if (qaio->limited) {
+		allowed += (allowed / 8) ? (allowed / 8) : 1;
+		if (allowed > qaio->depth) {
+			allowed = qaio->depth;
+		}
+	}
+	__atomic_store_n(&qaio->allowed, allowed, __ATOMIC_RELAXED);
+
+	qaio->lat_sum = 0;
+	qaio->lat_cnt = 0;
+	qaio->limited = false;
+}
+
+/*complete the task behind an iocb, a merge carrier splits its result back to each task*/
+static void eaio_iocb_done(struct eaio_queue *qaio, struct eaio_task *task, int result, uint64_t now)
+{
+	struct eaio_merge *merge = task->merge;
+
+	if (!merge) {
+		eaio_task_done(qaio, task, result, now);
+		return;
+	}
+
+	size_t skip = 0;
+	for (int i = 0; i < merge->nr; i++) {
+		struct eaio_task *one = merge->tasks[i];
+		int res = result;
+
+		if (result >= 0) {
+			size_t got = ((size_t)result > skip) ? (result - skip) : 0;
+			res = (got > one->bytes) ? one->bytes : got;
+		}
+		skip += one->bytes;
+		eaio_task_done(qaio, one, res, now);
+	}
+	merge->next = qaio->mfree;
+	qaio->mfree = merge;
+}
+
+/*reap everything the engine has ready*/
+static long eaio_queue_getevents(struct eaio_queue *qaio)
+{
+	struct io_event events[64];
+	long total = 0;
+	int nr_events;
+	uint64_t now = eaio_clock_ns();
+
+	do {
+		nr_events = qaio->ops->getevents(qaio, events, 64);
+		if (nr_events < 0) {
+			eaio_printf(LOG_ERR, "getevents ret %d: %s", nr_events, strerror(-nr_events));
+			break;
+		}
+
+		for (int i = 0; i < nr_events; i++) {
+			struct io_event *ev = &events[i];
+			struct eaio_task *task = TASK_FROM_DATA(ev->data);
+
+			__atomic_sub_fetch(&qaio->inflight, 1, __ATOMIC_RELAXED);
+			eaio_hist_add(&qaio->stats.service, now - task->stamp);
+			if (qaio->target_ns) {
+				eaio_queue_adapt(qaio, now - task->stamp);
+			}
+			eaio_iocb_done(qaio, task, ev->res, now);
+		}
+		total += nr_events;
+	} while (nr_events == 64);
+
+	return total;
+}
+
+/*t_fd serves the limits and the deadlines, keep it on the earliest of them*/
+static void eaio_queue_arm(struct eaio_queue *qaio, uint64_t when)
+{
+	if (qaio->t_armed && (qaio->t_armed <= when)) {
+		return;
+	}
+
+	struct itimerspec its = {
+		.it_value.tv_sec = when / NSEC_PER_SEC,
+		.it_value.tv_nsec = when % NSEC_PER_SEC,
+	};
+	timerfd_settime(qaio->t_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	qaio->t_armed = when;
+}
+
+/*tasks are held back by a limit or a barrier, arm t_fd for when a limit lets one go*/
+static void eaio_queue_throttle(struct eaio_queue *qaio)
+{
+	uint64_t wait = eaio_limiter_wait(&qaio->limit);
+
+	if (!wait) {
+		wait = UINT64_MAX;
+		for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+			if (!list_empty(&qaio->waiting[i])) {
+				uint64_t w = eaio_limiter_wait(&qaio->plimit[i]);
+				if (w && (w < wait)) {
+					wait = w;
+				}
+			}
+		}
+		if (wait == UINT64_MAX) {
+			/*held back by a barrier, the completions will kick us*/
+			return;
+		}
+	}
+	if (wait < 1000) {
+		wait = 1000;
+	}
+	eaio_queue_arm(qaio, eaio_clock_ns() + wait);
+}
+
+/*
+ * A waiting task fails at once. An inflight one keeps its buffer until the
+ * kernel gives it back, so it is only marked, and cancelled where the engine
+ * can; the mark replaces whatever result it completes with.
+ */
+static void eaio_task_abort(struct eaio_queue *qaio, struct eaio_task *task, int error, uint64_t now)
+{
+	if (task->error) {
+		return;
+	}
+	eaio_stat_add((error == -ETIMEDOUT) ? &qaio->stats.timeouts : &qaio->stats.cancels, 1);
+
+	if (!task->inflight) {
+		list_del(&task->node);
+		eaio_stat_sub(&qaio->stats.queued, 1);
+		eaio_task_done(qaio, task, error, now);
+		return;
+	}
+
+	task->error = error;
+	/*a merged task shares its iocb with others that did not ask for it*/
+	if (task->merged || !qaio->ops->cancel) {
+		return;
+	}
+	struct io_event ev = {};
+	if (qaio->ops->cancel(qaio, &task->iocb, &ev) == 1) {
+		__atomic_sub_fetch(&qaio->inflight, 1, __ATOMIC_RELAXED);
+		eaio_iocb_done(qaio, task, ev.res, now);
+	}
+}
+
+static void eaio_queue_cancel(struct eaio_queue *qaio, uint64_t id)
+{
+	struct eaio_task *task;
+
+	list_for_each_entry(task, &qaio->ordered, onode) {
+		if (task->id == id) {
+			eaio_task_abort(qaio, task, -ECANCELED, eaio_clock_ns());
+			return;
+		}
+	}
+}
+
+/*fail what outlived its deadline and keep t_fd on the next one*/
+static void eaio_queue_expire(struct eaio_queue *qaio)
+{
+	if (list_empty(&qaio->timed)) {
+		return;
+	}
+
+	uint64_t now = eaio_clock_ns();
+	uint64_t next = 0;
+	struct eaio_task *task;
+	list_for_each_entry(task, &qaio->timed, tnode) {
+		if (task->error) {
+			continue;
+		}
+		if (task->deadline <= now) {
+			eaio_task_abort(qaio, task, -ETIMEDOUT, now);
+		} else if (!next || (task->deadline < next)) {
+			next = task->deadline;
+		}
+	}
+	if (next) {
+		eaio_queue_arm(qaio, next);
+	}
+}
+
+static int task_cmp(struct eaio_task **t1, struct eaio_task **t2)
+{
+	const struct iocb *a = &(*t1)->iocb;
+	const struct iocb *b = &(*t2)->iocb;
+
+	if (a->aio_fildes != b->aio_fildes) {
+		return (a->aio_fildes < b->aio_fildes) ? -1 : 1;
+	}
+	if (a->u.c.offset != b->u.c.offset) {
+		return (a->u.c.offset < b->u.c.offset) ? -1 : 1;
+	}
+	return 0;
+}
+
+static bool eaio_task_mergeable(struct eaio_task *prev, struct eaio_task *next, size_t bytes)
+{
+	const struct iocb *a = &prev->iocb;
+	const struct iocb *b = &next->iocb;
+
+	return !prev->barrier && !next->barrier &&
+	       (a->aio_lio_opcode == b->aio_lio_opcode) &&
+	       ((a->aio_lio_opcode == IO_CMD_PREAD) || (a->aio_lio_opcode == IO_CMD_PWRITE)) &&
+	       (a->aio_fildes == b->aio_fildes) &&
+	       (a->u.c.offset + (long long)prev->bytes == b->u.c.offset) &&
+	       (bytes + next->bytes <= EAIO_MERGE_BYTES);
+}
+
+static struct eaio_merge *eaio_merge_alloc(struct eaio_queue *qaio)
+{
+	struct eaio_merge *merge = qaio->mfree;
+
+	if (merge) {
+		qaio->mfree = merge->next;
+	} else {
+		merge = malloc(sizeof(*merge));
+	}
+	return merge;
+}
+
+/*
+ * Elevator: sort the tasks of one dispatch round by (fd, offset) and turn each
+ * run of adjacent reads or writes into one vectored iocb.
+ * Return the number of iocbs stored in iocbp.
+ */
+static int eaio_queue_merge(struct eaio_queue *qaio, struct eaio_task **tasks, int nr, struct iocb **iocbp)
+{
+	int cnt = 0;
+
+	xqsort(tasks, nr, task_cmp);
+	for (int i = 0; i < nr; ) {
+		int j = i + 1;
+		size_t bytes = tasks[i]->bytes;
+
+		while ((j < nr) && (j - i < EAIO_MERGE_SEGS) && eaio_task_mergeable(tasks[j - 1], tasks[j], bytes)) {
+			bytes += tasks[j]->bytes;
+			j++;
+		}
+
+		struct eaio_merge *merge = (j - i > 1) ? eaio_merge_alloc(qaio) : NULL;
+		if (!merge) {
+			for (; i < j; i++) {
+				iocbp[cnt++] = &tasks[i]->iocb;
+			}
+			continue;
+		}
+
+		struct eaio_task *carrier = &merge->carrier;
+		const struct iocb *head = &tasks[i]->iocb;
+		merge->nr = j - i;
+		for (int k = 0; k < merge->nr; k++) {
+			merge->tasks[k] = tasks[i + k];
+			merge->tasks[k]->merged = true;
+			merge->iov[k].iov_base = tasks[i + k]->iocb.u.c.buf;
+			merge->iov[k].iov_len = tasks[i + k]->bytes;
+		}
+		memset(carrier, 0, sizeof(*carrier));
+		if (head->aio_lio_opcode == IO_CMD_PREAD) {
+			io_prep_preadv(&carrier->iocb, head->aio_fildes, merge->iov, merge->nr, head->u.c.offset);
+		} else {
+			io_prep_pwritev(&carrier->iocb, head->aio_fildes, merge->iov, merge->nr, head->u.c.offset);
+		}
+		carrier->iocb.data = DATA_FROM_TASK(carrier);
+		carrier->merge = merge;
+		carrier->bytes = bytes;
+		carrier->stamp = tasks[i]->stamp;
+		iocbp[cnt++] = &carrier->iocb;
+		i = j;
+	}
+	return cnt;
+}
+
+static int eaio_queue_try_inflight_and_submit(struct eaio_queue *qaio)
+{
+	struct eaio_task **tasks = qaio->dispatch;
+	struct iocb **iocbp = qaio->iocbp;
+
+	int done = 0;
+	int todo = qaio->allowed - __atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED);
+	if (todo < 0) {
+		todo = 0;
+	}
+	eaio_queue_drain(qaio);
+	uint64_t now = eaio_clock_ns();
+	if (!list_empty(&qaio->timed)) {
+		eaio_queue_promote(qaio, now);
+	}
+	eaio_limiter_refill(&qaio->limit, now);
+	for (int i = 0; i < EAIO_PRIO_MAX; i++) {
+		eaio_limiter_refill(&qaio->plimit[i], now);
+	}
+	while (todo && eaio_limiter_ok(&qaio->limit) && eaio_queue_ready(qaio)) {
+		int prio = eaio_queue_expired(qaio, now);
+		if (prio < 0) {
+			prio = qaio->sched->pick(qaio);
+		}
+		struct eaio_task *task = eaio_queue_head(qaio, prio);
+
+		qaio->sched->charge(qaio, prio, task);
+		eaio_limiter_take(&qaio->limit, task->bytes);
+		eaio_limiter_take(&qaio->plimit[prio], task->bytes);
+		task->stamp = now;
+		task->inflight = true;
+		tasks[done] = task;
+		eaio_hist_add(&qaio->stats.wait, now - task->qstamp);
+		eaio_task_trace(qaio, task, EAIO_TRACE_DISPATCH, now, 0);
+		eaio_stat_add(&qaio->stats.cls[prio].submitted, 1);
+
+		list_del(&task->node);
+		done ++;
+		todo --;
+	}
+	eaio_stat_sub(&qaio->stats.queued, done);
+	eaio_stat_add(&qaio->stats.submitted, done);
+	if (eaio_queue_pending(qaio)) {
+		if (!todo) {
+			qaio->limited = true;
+		} else {
+			eaio_queue_throttle(qaio);
+		}
+	}
+
+	int nr = done;
+	if (qaio->merge && (done > 1)) {
+		nr = eaio_queue_merge(qaio, tasks, done, iocbp);
+	} else {
+		for (int i = 0; i < done; i++) {
+			iocbp[i] = &tasks[i]->iocb;
+		}
+	}
+
+	if (nr) {
+		int first = 0;
+		do {
+			int ret = qaio->ops->submit(qaio, &iocbp[first], nr - first);
+			if (ret < 0) {
+				eaio_printf(LOG_INFO, "io %d submited ret %d: %s", nr - first, ret, strerror(-ret));
+				struct eaio_task *task = TASK_FROM_DATA(iocbp[first]->data);
+				first ++;
+				eaio_stat_add(&qaio->stats.submit_errors, 1);
+				eaio_iocb_done(qaio, task, ret, now);
+			} else {
+				//eaio_printf(LOG_DEBUG, "io %d submited ret %d", done - first, ret);
+				__atomic_add_fetch(&qaio->inflight, ret, __ATOMIC_RELAXED);
+				eaio_stat_add(&qaio->stats.iocbs, ret);
+				first += ret;
+			}
+		} while (first < nr);
+
+		uint64_t inflight = __atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED);
+		eaio_stat_add(&qaio->stats.rounds, 1);
+		eaio_stat_add(&qaio->stats.inflight_sum, inflight);
+		if (inflight > qaio->stats.inflight_max) {
+			__atomic_store_n(&qaio->stats.inflight_max, inflight, __ATOMIC_RELAXED);
+		}
+	}
+
+	return done;
+}
+
+int eaio_context_init(struct eaio_context *aio_ctx, int qmax)
+{
+	return eaio_context_init_attr(aio_ctx, qmax, NULL);
+}
+
+/*
+ * The cpus of each node are dealt round robin over the queues bound to it, the
+ * others over all queues. Without the table every submitter lands on queue 0.
+ */
+static void eaio_context_map_local(struct eaio_context *aio_ctx)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpus <= 0) {
+		return;
+	}
+	if (ncpus > CPU_SETSIZE) {
+		ncpus = CPU_SETSIZE;
+	}
+	aio_ctx->local = malloc(ncpus * sizeof(int));
+	if (!aio_ctx->local) {
+		return;
+	}
+	aio_ctx->nlocal = ncpus;
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		aio_ctx->local[cpu] = cpu % aio_ctx->qcnts;
+	}
+
+	int nodes = eaio_numa_nodes();
+	for (int node = 0; node < nodes; node++) {
+		cpu_set_t set;
+		int bound = 0;
+		for (int q = 0; q < aio_ctx->qcnts; q++) {
+			bound += (aio_ctx->qslot[q].node == node);
+		}
+		if (!bound || (eaio_numa_cpus(node, &set) < 0)) {
+			continue;
+		}
+		int k = 0;
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			if (!CPU_ISSET(cpu, &set)) {
+				continue;
+			}
+			int nth = k++ % bound;
+			for (int q = 0; q < aio_ctx->qcnts; q++) {
+				if ((aio_ctx->qslot[q].node == node) && !nth--) {
+					aio_ctx->local[cpu] = q;
+					break;
+				}
+			}
+		}
+	}
+}
+
+int eaio_context_local_queue(struct eaio_context *aio_ctx, int node)
+{
+	int cpu = sched_getcpu();
+
+	if (node >= 0) {
+		int bound = 0;
+		for (int q = 0; q < aio_ctx->qcnts; q++) {
+			bound += (aio_ctx->qslot[q].node == node);
+		}
+		if (bound) {
+			int nth = ((cpu >= 0) ? cpu : 0) % bound;
+			for (int q = 0; q < aio_ctx->qcnts; q++) {
+				if ((aio_ctx->qslot[q].node == node) && !nth--) {
+					return q;
+				}
+			}
+		}
+	}
+	return ((cpu >= 0) && (cpu < aio_ctx->nlocal)) ? aio_ctx->local[cpu] : 0;
+}
+
+int eaio_context_init_attr(struct eaio_context *aio_ctx, int qmax, const struct eaio_attr *attr)
+{
+	if (qmax <= 0) {
+		return -1;
+	}
+
+	const struct eaio_qattr *qattr = attr ? attr->qattr : NULL;
+	const struct eaio_engine_ops *ops = &eaio_engine_libaio;
+	if (attr && (attr->engine == EAIO_ENGINE_URING)) {
+		ops = &eaio_engine_uring;
+	}
+
+	aio_ctx->eslot = NULL;
+	aio_ctx->ecnts = 0;
+	aio_ctx->filters = NULL;
+	aio_ctx->nlocal = 0;
+	aio_ctx->local = NULL;
+	aio_ctx->spin_ns = (attr && (attr->spin_us > 0)) ? attr->spin_us * 1000ULL : 0;
+	aio_ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (aio_ctx->epfd < 0) {
+		return -1;
+	}
+	aio_ctx->qslot = calloc(qmax, sizeof(struct eaio_queue));
+	aio_ctx->qcnts = qmax;
+
+	int idx = 0;
+	for (; idx < qmax; idx++) {
+		struct eaio_queue *qaio = &aio_ctx->qslot[idx];
+		struct eaio_numa_policy pol;
+		/*the kernel allocates the rings for the calling thread, let it be the node's*/
+		int node = (qattr && qattr[idx].numa) ? qattr[idx].node : -1;
+		eaio_numa_enter(node, &pol);
+		int ret = eaio_queue_init(qaio, ops, qattr ? &qattr[idx] : NULL);
+		eaio_numa_leave(&pol);
+		qaio->ring = aio_ctx->spin_ns > 0;
+		if (ret == 0) {
+			ret = eaio_queue_watch(qaio, aio_ctx->epfd);
+			if (ret < 0) {
+				eaio_queue_free(qaio);
+			}
+		}
+		if (ret < 0) {
+			for (int i = 0; i < idx; i++) {
+				eaio_queue_free(&aio_ctx->qslot[i]);
+			}
+			free(aio_ctx->qslot);
+			close(aio_ctx->epfd);
+			aio_ctx->qslot = NULL;
+			aio_ctx->qcnts = 0;
+			aio_ctx->epfd = -1;
+			return -1;
+		}
+	}
+	eaio_context_map_local(aio_ctx);
+	return 0;
+}
+
+int eaio_context_exit(struct eaio_context *aio_ctx)
+{
+	eaio_context_stop(aio_ctx);
+
+	for (int i = 0; i < aio_ctx->qcnts; i++) {
+		struct eaio_queue *qaio = &aio_ctx->qslot[i];
+		eaio_queue_free(qaio);
+	}
+	free(aio_ctx->qslot);
+	close(aio_ctx->epfd);
+	free(aio_ctx->local);
+	aio_ctx->qslot = NULL;
+	aio_ctx->qcnts = 0;
+	aio_ctx->epfd = -1;
+	aio_ctx->local = NULL;
+	aio_ctx->nlocal = 0;
+	return 0;
+}
+
+int eaio_context_stats(struct eaio_context *aio_ctx, int qnum, struct eaio_qstats *stats)
+{
+	if (qnum >= aio_ctx->qcnts) {
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < aio_ctx->qcnts; i++) {
+		struct eaio_queue *qaio = &aio_ctx->qslot[i];
+		if ((qnum >= 0) && (i != qnum)) {
+			continue;
+		}
+		eaio_qstats_merge(stats, &qaio->stats);
+		stats->inflight += __atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED);
+		stats->allowed += __atomic_load_n(&qaio->allowed, __ATOMIC_RELAXED);
+		stats->depth += qaio->depth;
+	}
+	return 0;
+}
+
+
+int eaio_context_trace_dump(struct eaio_context *aio_ctx, int qnum, FILE *fp, enum eaio_trace_format format)
+{
+	if ((qnum < 0) || (qnum >= aio_ctx->qcnts) || !aio_ctx->qslot[qnum].trace) {
+		return -1;
+	}
+
+	struct eaio_trace *trace = aio_ctx->qslot[qnum].trace;
+	int max = trace->mask + 1;
+	struct eaio_trace_rec *recs = malloc(max * sizeof(*recs));
+	if (!recs) {
+		return -1;
+	}
+	int nr = eaio_trace_snapshot(trace, recs, max);
+	eaio_trace_print(fp, recs, nr, format);
+	free(recs);
+	return nr;
+}
+
+
+static void eaio_queue_dispatch(struct eaio_queue *qaio)
+{
+	eaio_queue_drain(qaio);
+	eaio_queue_expire(qaio);
+	/*stop once a round dispatches nothing, a limit has armed t_fd then*/
+	while (eaio_queue_try_inflight_and_submit(qaio) > 0) {
+		if ((__atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED) >= qaio->allowed) ||
+			!eaio_queue_have_waiting(qaio)) {
+			break;
+		}
+	}
+}
+
+/*handle one edge of i_efd, o_efd or t_fd*/
+static void eaio_queue_process(struct eaio_queue *qaio, int kind)
+{
+	int fd = (kind == EAIO_KEY_IN) ? qaio->i_efd : (kind == EAIO_KEY_OUT) ? qaio->o_efd : qaio->t_fd;
+	eventfd_t cnt = 0;
+	int ret = eventfd_xrecv(fd, &cnt);
+	if ((ret != 0) || (cnt == 0)) {
+		return;
+	}
+
+	if (kind == EAIO_KEY_OUT) {
+		eaio_queue_getevents(qaio);
+	} else if (kind == EAIO_KEY_TIMER) {
+		qaio->t_armed = 0;
+	}
+	eaio_queue_dispatch(qaio);
+}
+
+/*
+ * Busy poll of a queue by its executor: reap what the engine has and take the
+ * inbox without waiting for o_efd or i_efd, whose counters are left to fire
+ * later for nothing. Return true if there was anything to do.
+ */
+static bool eaio_queue_poll(struct eaio_queue *qaio)
+{
+	long nr = 0;
+
+	if (__atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED) > 0) {
+		nr = eaio_queue_getevents(qaio);
+	}
+	if (!nr && mpsc_empty(&qaio->inbox)) {
+		return false;
+	}
+	eaio_queue_dispatch(qaio);
+	return true;
+}
+
+/*one round over an epoll set, return false once a NULL (stop) key is seen*/
+static bool eaio_epoll_exec(int epfd, int timeout)
+{
+	struct epoll_event evs[EAIO_EPOLL_EVENTS];
+	bool goon = true;
+
+	int evts = epoll_wait(epfd, evs, EAIO_EPOLL_EVENTS, timeout);
+	if (evts < 0) {
+		assert((errno == EINTR) || (errno == EAGAIN));
+		return goon;
+	}
+
+	for (int i = 0; i < evts; i++) {
+		uintptr_t key = (uintptr_t)evs[i].data.ptr;
+
+		if (!key) {
+			goon = false;
+			continue;
+		}
+		eaio_queue_process(QUEUE_FROM_KEY(key), KEY_KIND(key));
+	}
+	return goon;
+}
+
+/*idle spins between two looks at the epoll set for timers and stop*/
+#define EAIO_SPIN_EPOLL 64
+
+struct eaio_executor {
+	pthread_t tid;
+	int epfd;	/*the queues of this executor plus stop_efd*/
+	int stop_efd;
+
+	/*queues first, first + step, ... of aio_ctx*/
+	struct eaio_context *aio_ctx;
+	int first;
+	int step;
+};
+
+/*
+ * Poll queues first, first + step, ... until spin_ns pass without any work, so
+ * a completion landing meanwhile is picked up without a wakeup; epfd is the
+ * epoll set they are watched by. Return false on stop.
+ */
+static bool eaio_context_spin(struct eaio_context *aio_ctx, int epfd, int first, int step)
+{
+	uint64_t until = eaio_clock_ns() + aio_ctx->spin_ns;
+	int idle = 0;
+
+	for (;;) {
+		bool busy = false;
+		bool wait = false;
+
+		for (int q = first; q < aio_ctx->qcnts; q += step) {
+			struct eaio_queue *qaio = &aio_ctx->qslot[q];
+
+			busy |= eaio_queue_poll(qaio);
+			wait |= (__atomic_load_n(&qaio->inflight, __ATOMIC_RELAXED) > 0);
+		}
+		/*nothing can complete, whatever comes next has to wake us anyway*/
+		if (!busy && !wait) {
+			return true;
+		}
+
+		uint64_t now = eaio_clock_ns();
+		if (busy) {
+			until = now + aio_ctx->spin_ns;
+			idle = 0;
+		} else if (now >= until) {
+			return true;
+		} else if (++idle % EAIO_SPIN_EPOLL == 0) {
+			if (!eaio_epoll_exec(epfd, 0)) {
+				return false;
+			}
+		}
+	}
+}
+
+static void *eaio_executor_loop(void *arg)
+{
+	struct eaio_executor *exec = arg;
+	struct eaio_context *aio_ctx = exec->aio_ctx;
+
+	while (eaio_epoll_exec(exec->epfd, -1)) {
+		if (aio_ctx->spin_ns && !eaio_context_spin(aio_ctx, exec->epfd, exec->first, exec->step)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+int eaio_context_exec(struct eaio_context *aio_ctx)
+{
+	if (eaio_epoll_exec(aio_ctx->epfd, -1) && aio_ctx->spin_ns) {
+		eaio_context_spin(aio_ctx, aio_ctx->epfd, 0, 1);
+	}
+	return 0;
+}
+
+static int eaio_executor_init(struct eaio_executor *exec)
+{
+	exec->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (exec->epfd < 0) {
+		return -1;
+	}
+	exec->stop_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (exec->stop_efd < 0) {
+		close(exec->epfd);
+		return -1;
+	}
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	if (epoll_ctl(exec->epfd, EPOLL_CTL_ADD, exec->stop_efd, &ev) < 0) {
+		close(exec->stop_efd);
+		close(exec->epfd);
+		return -1;
+	}
+	return 0;
+}
+
+static void eaio_executor_free(struct eaio_executor *exec)
+{
+	close(exec->stop_efd);
+	close(exec->epfd);
+}
+
+int eaio_context_start(struct eaio_context *aio_ctx, int nthreads, const int *cpus)
+{
+	if ((nthreads <= 0) || aio_ctx->eslot) {
+		return -1;
+	}
+	if (nthreads > aio_ctx->qcnts) {
+		nthreads = aio_ctx->qcnts;
+	}
+
+	aio_ctx->eslot = calloc(nthreads, sizeof(struct eaio_executor));
+	if (!aio_ctx->eslot) {
+		return -1;
+	}
+
+	int idx = 0;
+	for (; idx < nthreads; idx++) {
+		struct eaio_executor *exec = &aio_ctx->eslot[idx];
+		if (eaio_executor_init(exec) < 0) {
+			goto fail;
+		}
+		exec->aio_ctx = aio_ctx;
+		exec->first = idx;
+		exec->step = nthreads;
+
+		/*each queue has exactly one executor, its only consumer*/
+		for (int q = idx; q < aio_ctx->qcnts; q += nthreads) {
+			if (eaio_queue_watch(&aio_ctx->qslot[q], exec->epfd) < 0) {
+				eaio_executor_free(exec);
+				goto fail;
+			}
+		}
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		cpu_set_t set;
+		if (cpus && (cpus[idx] >= 0)) {
+			CPU_ZERO(&set);
+			CPU_SET(cpus[idx], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		} else if (eaio_numa_cpus(aio_ctx->qslot[idx].node, &set) == 0) {
+			/*completions are reaped, and tasks and merges touched, where the queue's memory is*/
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		int ret = pthread_create(&exec->tid, &attr, eaio_executor_loop, exec);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			eaio_executor_free(exec);
+			goto fail;
+		}
+	}
+	aio_ctx->ecnts = nthreads;
+	return 0;
+fail:
+	for (int i = 0; i < idx; i++) {
+		struct eaio_executor *exec = &aio_ctx->eslot[i];
+		eventfd_xsend(exec->stop_efd, 1);
+		pthread_join(exec->tid, NULL);
+		eaio_executor_free(exec);
+	}
+	free(aio_ctx->eslot);
+	aio_ctx->eslot = NULL;
+	return -1;
+}
+
+int eaio_context_stop(struct eaio_context *aio_ctx)
+{
+	for (int i = 0; i < aio_ctx->ecnts; i++) {
+		struct eaio_executor *exec = &aio_ctx->eslot[i];
+		eventfd_xsend(exec->stop_efd, 1);
+		pthread_join(exec->tid, NULL);
+		eaio_executor_free(exec);
+	}
+	free(aio_ctx->eslot);
+	aio_ctx->eslot = NULL;
+	aio_ctx->ecnts = 0;
+	return 0;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+static void eaio_task_prep(struct eaio_context *aio_ctx, struct eaio_task *task,
+		enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset)
+{
+	INIT_LIST_NODE(&task->node);
+	INIT_LIST_NODE(&task->onode);
+	task->inode.next = NULL;
+
+	task->barrier = (opt & EAIO_OPT_BARRIER) ? true : false;
+	opt &= ~EAIO_OPT_BARRIER;
+	task->inflight = false;
+	task->merged = false;
+	INIT_LIST_NODE(&task->tnode);
+	task->id = 0;
+	task->deadline = 0;
+	task->expire = 0;
+	task->promoted = false;
+	task->error = 0;
+	task->victim = 0;
+	task->around = NULL;
+
+	task->result = 0;
+	if (qnum < 0) {
+		qnum = eaio_context_local_queue(aio_ctx, -1);
+	}
+	task->qnum = qnum % aio_ctx->qcnts;
+	task->prio = prio % EAIO_PRIO_MAX;
+
+	task->bytes = count;
+	switch (opt) {
+		case EAIO_OPT_PWRITE:
+			io_prep_pwrite(&task->iocb, fd, buf, count, offset);
+			break;
+		case EAIO_OPT_PREAD:
+			io_prep_pread(&task->iocb, fd, buf, count, offset);
+			break;
+		case EAIO_OPT_POLL:
+			io_prep_poll(&task->iocb, fd, *(int *)buf);
+			task->bytes = 0;
+			break;
+		case EAIO_OPT_PREADV:
+			io_prep_preadv(&task->iocb, fd, (const struct iovec *)buf, count, offset);
+			task->bytes = iov_length((const struct iovec *)buf, count);
+			break;
+		case EAIO_OPT_PWRITEV:
+			io_prep_pwritev(&task->iocb, fd, (const struct iovec *)buf, count, offset);
+			task->bytes = iov_length((const struct iovec *)buf, count);
+			break;
+		case EAIO_OPT_FSYNC:
+			io_prep_fsync(&task->iocb, fd);
+			task->bytes = 0;
+			break;
+		case EAIO_OPT_FDSYNC:
+			io_prep_fdsync(&task->iocb, fd);
+			task->bytes = 0;
+			break;
+		default:
+			assert(0);
+	}
+	task->iocb.data = DATA_FROM_TASK(task);
+}
+
+static int eaio_waiter_init(struct eaio_waiter *waiter, eaio_watch_fcb_t fcb, int pending)
+{
+	/*no fd per request: a futex when nobody watches, else the thread's own eventfd*/
+	waiter->efd = -1;
+	if (fcb) {
+		waiter->efd = eventfd_local();
+		if (waiter->efd < 0) {
+			return -1;
+		}
+	}
+	ewait_init(&waiter->wait);
+	waiter->pending = pending;
+	return 0;
+}
+
+static void eaio_waiter_wait(struct eaio_waiter *waiter, eaio_watch_fcb_t fcb, void *usr)
+{
+	if (fcb) {
+		fcb(waiter->efd, usr);
+	} else {
+		ewait_sleep(&waiter->wait);
+	}
+}
+
+/*timeout in msec; the deadline is made absolute when the task is enqueued*/
+static eaio_tag_t eaio_task_tag(struct eaio_context *aio_ctx, struct eaio_task *task, int timeout)
+{
+	struct eaio_queue *qaio = &aio_ctx->qslot[task->qnum];
+
+	task->id = __atomic_add_fetch(&qaio->next_id, 1, __ATOMIC_RELAXED);
+	task->deadline = (timeout > 0) ? (uint64_t)timeout * 1000000 : 0;
+	return (task->id << EAIO_TAG_QNUM_BITS) | task->qnum;
+}
+
+int eaio_context_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset,
+		eaio_watch_fcb_t fcb, void *usr)
+{
+	return eaio_context_rdwt_timed(aio_ctx, opt, qnum, prio, fd, buf, count, offset, 0, fcb, usr);
+}
+
+static int eaio_queue_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_watch_fcb_t fcb, void *usr);
+
+int eaio_filter_next(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_filter *next = flt->next;
+
+	if (next) {
+		return next->ops->rdwt(next, req);
+	}
+	return eaio_queue_rdwt(flt->aio_ctx, req->opt, req->qnum, req->prio,
+			req->fd, req->buf, req->count, req->offset, req->timeout, req->fcb, req->usr);
+}
+
+int eaio_filter_write_around(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	size_t len = eaio_filter_req_len(req);
+
+	/*len 0 would be the whole file*/
+	flt->ops->invalidate(flt, req->fd, req->offset, len ? len : 1);
+	int ret = eaio_filter_next(flt, req);
+	flt->ops->invalidate(flt, req->fd, req->offset, len ? len : 1);
+	return ret;
+}
+
+void eaio_context_push_filter(struct eaio_context *aio_ctx, struct eaio_filter *flt,
+		const struct eaio_filter_ops *ops)
+{
+	flt->ops = ops;
+	flt->aio_ctx = aio_ctx;
+	flt->next = aio_ctx->filters;
+	aio_ctx->filters = flt;
+}
+
+void eaio_context_remove_filter(struct eaio_context *aio_ctx, struct eaio_filter *flt)
+{
+	for (struct eaio_filter **pp = &aio_ctx->filters; *pp; pp = &(*pp)->next) {
+		if (*pp == flt) {
+			*pp = flt->next;
+			flt->next = NULL;
+			return;
+		}
+	}
+}
+
+void eaio_context_invalidate(struct eaio_context *aio_ctx, int fd, off_t offset, size_t len)
+{
+	for (struct eaio_filter *flt = aio_ctx->filters; flt; flt = flt->next) {
+		if (flt->ops->invalidate) {
+			flt->ops->invalidate(flt, fd, offset, len);
+		}
+	}
+}
+
+static int eaio_filters_flush(struct eaio_context *aio_ctx, int fd, off_t offset, size_t len)
+{
+	int error = 0;
+
+	/*top down, what a layer writes out may stop in the ones below*/
+	for (struct eaio_filter *flt = aio_ctx->filters; flt; flt = flt->next) {
+		if (flt->ops->flush) {
+			int ret = flt->ops->flush(flt, fd, offset, len);
+			if ((ret < 0) && !error) {
+				error = -ret;
+			}
+		}
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int eaio_flush(struct eaio_context *aio_ctx, int fd)
+{
+	return eaio_filters_flush(aio_ctx, fd, 0, 0);
+}
+
+/*what a layer without a submit op gets of an async write: its range dropped*/
+static void eaio_filter_bypass(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	if ((req->fd >= 0) && eaio_filter_is_write(req) && flt->ops->invalidate) {
+		size_t len = eaio_filter_req_len(req);
+		flt->ops->invalidate(flt, req->fd, req->offset, len ? len : 1);
+	}
+}
+
+int eaio_context_rdwt_timed(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_watch_fcb_t fcb, void *usr)
+{
+	struct eaio_filter *top = aio_ctx->filters;
+
+	if (top) {
+		struct eaio_filter_req req = {
+			.opt = opt,
+			.qnum = qnum,
+			.prio = prio,
+			.fd = fd,
+			.buf = buf,
+			.count = count,
+			.offset = offset,
+			.timeout = timeout,
+			.fcb = fcb,
+			.usr = usr,
+		};
+		return top->ops->rdwt(top, &req);
+	}
+	return eaio_queue_rdwt(aio_ctx, opt, qnum, prio, fd, buf, count, offset, timeout, fcb, usr);
+}
+
+static int eaio_queue_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_watch_fcb_t fcb, void *usr)
+{
+	struct eaio_waiter waiter;
+	if (eaio_waiter_init(&waiter, fcb, 1) < 0) {
+		return -1;
+	}
+
+	if (qnum < 0) {
+		qnum = eaio_context_local_queue(aio_ctx, -1);
+	}
+	struct eaio_queue *qaio = &aio_ctx->qslot[qnum % aio_ctx->qcnts];
+	struct eaio_task *task = eaio_task_alloc(qaio);
+	if (!task) {
+		return -1;
+	}
+	eaio_task_prep(aio_ctx, task, opt, qnum, prio, fd, buf, count, offset);
+	task->waiter = &waiter;
+	if (timeout > 0) {
+		eaio_task_tag(aio_ctx, task, timeout);
+	}
+
+	eaio_queue_enqueue(qaio, task, 1);
+	eaio_waiter_wait(&waiter, fcb, usr);
+
+	int result = task->result;
+	eaio_task_free(qaio, task);
+	if (result < 0) {
+		errno = -result;
+		result = -1;
+		fprintf(stderr, "failed: %s\n", strerror(errno));
+	}
+
+	return result;
+}
+
+static int eaio_filters_submit(struct eaio_context *aio_ctx, struct eaio_filter *flt,
+		const struct eaio_filter_req *req);
+
+struct eaio_batch_one {
+	struct eaio_waiter *waiter;
+	struct eaio_rdwt_vec *vec;
+};
+
+static void eaio_batch_done(int result, void *usr)
+{
+	struct eaio_batch_one *one = usr;
+
+	one->vec->result = result;
+	eaio_waiter_wake(one->waiter);
+}
+
+/*with filters every request of the batch takes its own way down the chain*/
+static int eaio_filters_batch(struct eaio_context *aio_ctx, int qnum, int prio,
+		struct eaio_rdwt_vec *vec, int nr, struct eaio_waiter *waiter,
+		eaio_watch_fcb_t fcb, void *usr)
+{
+	struct eaio_batch_one *ones = calloc(nr, sizeof(struct eaio_batch_one));
+	if (!ones) {
+		return -1;
+	}
+	if (qnum < 0) {
+		qnum = eaio_context_local_queue(aio_ctx, -1);
+	}
+	for (int i = 0; i < nr; i++) {
+		struct eaio_filter_req req = {
+			.opt = vec[i].opt,
+			.qnum = qnum,
+			.prio = prio,
+			.fd = vec[i].fd,
+			.buf = vec[i].buf,
+			.count = vec[i].count,
+			.offset = vec[i].offset,
+			.done = eaio_batch_done,
+			.usr = &ones[i],
+		};
+		ones[i].waiter = waiter;
+		ones[i].vec = &vec[i];
+		if (eaio_filters_submit(aio_ctx, aio_ctx->filters, &req) < 0) {
+			eaio_batch_done(-errno, &ones[i]);
+		}
+	}
+	eaio_waiter_wait(waiter, fcb, usr);
+	free(ones);
+
+	int failed = 0;
+	for (int i = 0; i < nr; i++) {
+		failed += (vec[i].result < 0);
+	}
+	return failed;
+}
+
+int eaio_context_rdwt_batch(struct eaio_context *aio_ctx, int qnum, int prio,
+		struct eaio_rdwt_vec *vec, int nr,
+		eaio_watch_fcb_t fcb, void *usr)
+{
+	if (nr <= 0) {
+		return 0;
+	}
+
+	struct eaio_waiter waiter;
+	if (eaio_waiter_init(&waiter, fcb, nr) < 0) {
+		return -1;
+	}
+	if (aio_ctx->filters) {
+		return eaio_filters_batch(aio_ctx, qnum, prio, vec, nr, &waiter, fcb, usr);
+	}
+
+	struct eaio_task *tasks = calloc(nr, sizeof(struct eaio_task));
+	if (!tasks) {
+		return -1;
+	}
+	for (int i = 0; i < nr; i++) {
+		eaio_task_prep(aio_ctx, &tasks[i], vec[i].opt, qnum, prio,
+				vec[i].fd, vec[i].buf, vec[i].count, vec[i].offset);
+		tasks[i].waiter = &waiter;
+	}
+
+	eaio_queue_enqueue(&aio_ctx->qslot[tasks[0].qnum], tasks, nr);
+	eaio_waiter_wait(&waiter, fcb, usr);
+
+	int failed = 0;
+	for (int i = 0; i < nr; i++) {
+		vec[i].result = tasks[i].result;
+		if (tasks[i].result < 0) {
+			failed ++;
+		}
+	}
+	free(tasks);
+
+	return failed;
+}
+
+int eaio_context_submit(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset,
+		eaio_done_fcb_t done, void *usr)
+{
+	return eaio_context_submit_timed(aio_ctx, opt, qnum, prio, fd, buf, count, offset, 0, done, usr, NULL);
+}
+
+static int eaio_queue_submit(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_done_fcb_t done, void *usr, eaio_tag_t *tag, bool around)
+{
+	assert(done);
+
+	if (qnum < 0) {
+		qnum = eaio_context_local_queue(aio_ctx, -1);
+	}
+	struct eaio_queue *qaio = &aio_ctx->qslot[qnum % aio_ctx->qcnts];
+	struct eaio_task *task = eaio_task_alloc(qaio);
+	if (!task) {
+		return -1;
+	}
+	eaio_task_prep(aio_ctx, task, opt, qnum, prio, fd, buf, count, offset);
+	task->done = done;
+	task->usr = usr;
+	task->around = around ? aio_ctx : NULL;
+	if ((timeout > 0) || tag) {
+		eaio_tag_t t = eaio_task_tag(aio_ctx, task, timeout);
+		if (tag) {
+			*tag = t;
+		}
+	}
+
+	eaio_queue_enqueue(qaio, task, 1);
+	return 0;
+}
+
+/*
+ * Hand req to flt or the first layer below it with a submit op, the queues when
+ * there is none; the writes reaching them drop their range from every layer once
+ * done, for the fills that raced with them.
+ */
+static int eaio_filters_submit(struct eaio_context *aio_ctx, struct eaio_filter *flt,
+		const struct eaio_filter_req *req)
+{
+	for (; flt; flt = flt->next) {
+		if (flt->ops->submit) {
+			return flt->ops->submit(flt, req);
+		}
+		eaio_filter_bypass(flt, req);
+	}
+	return eaio_queue_submit(aio_ctx, req->opt, req->qnum, req->prio, req->fd, req->buf, req->count,
+			req->offset, req->timeout, req->done, req->usr, req->tag, eaio_filter_is_write(req));
+}
+
+int eaio_context_submit_timed(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_done_fcb_t done, void *usr, eaio_tag_t *tag)
+{
+	if (aio_ctx->filters) {
+		struct eaio_filter_req req = {
+			.opt = opt,
+			.qnum = qnum,
+			.prio = prio,
+			.fd = fd,
+			.buf = buf,
+			.count = count,
+			.offset = offset,
+			.timeout = timeout,
+			.usr = usr,
+			.done = done,
+			.tag = tag,
+		};
+		if (tag) {
+			*tag = 0;
+		}
+		return eaio_filters_submit(aio_ctx, aio_ctx->filters, &req);
+	}
+	return eaio_queue_submit(aio_ctx, opt, qnum, prio, fd, buf, count, offset, timeout, done, usr, tag, false);
+}
+
+int eaio_filter_submit_next(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	return eaio_filters_submit(flt->aio_ctx, flt->next, req);
+}
+
+int eaio_filter_submit(struct eaio_filter *flt, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset,
+		eaio_done_fcb_t done, void *usr)
+{
+	return eaio_queue_submit(flt->aio_ctx, opt, qnum, prio, fd, buf, count, offset, 0, done, usr, NULL, false);
+}
+
+int eaio_context_cancel(struct eaio_context *aio_ctx, eaio_tag_t tag)
+{
+	int qnum = tag & ((1 << EAIO_TAG_QNUM_BITS) - 1);
+	uint64_t id = tag >> EAIO_TAG_QNUM_BITS;
+	if (!id || (qnum >= aio_ctx->qcnts)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*a cancel travels through the inbox too, so it always finds its victim drained*/
+	struct eaio_queue *qaio = &aio_ctx->qslot[qnum];
+	struct eaio_task *task = eaio_task_alloc(qaio);
+	if (!task) {
+		return -1;
+	}
+	task->victim = id;
+	task->qnum = qnum;
+
+	mpsc_push(&qaio->inbox, &task->inode);
+	eventfd_xsend(qaio->i_efd, 1);
+	return 0;
 }
@@ -2,45 +2,324 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <libaio.h>
 
 #include "list.h"
+#include "mpsc.h"
+#include "eaio_stats.h"
+#include "eaio_trace.h"
 
-#define EAIO_PRIO_MAX     2
+#define EAIO_PRIO_MAX     8	/*0 is the most urgent class*/
 
 enum eaio_opt {
 	EAIO_OPT_PREAD = 0,
 	EAIO_OPT_PWRITE = 1,
 	/* Jeff Moyer says io_prep_poll was implemented in Red Hat AS2.1 and RHEL3.
 	 * AFAICT, it was never in mainline, and should not be used. --RR */
-	EAIO_OPT_POLL = 2
+	EAIO_OPT_POLL = 2,
+	/* buf is a const struct iovec array and count its number of entries,
+	 * the segments are read/written back to back starting at offset. */
+	EAIO_OPT_PREADV = 3,
+	EAIO_OPT_PWRITEV = 4,
+	/* buf and count are ignored, offset too. */
+	EAIO_OPT_FSYNC = 5,
+	EAIO_OPT_FDSYNC = 6
 };
 
+/*
+ * Or'ed into an eaio_opt: the request is dispatched only after every write or
+ * sync queued before it on the same fd and queue has completed.
+ */
+#define EAIO_OPT_BARRIER 0x100
+
+enum eaio_sched {
+	EAIO_SCHED_STRICT = 0,	/*always drain the lowest non-empty class first*/
+	EAIO_SCHED_DRR = 1	/*deficit round robin over the classes by weight*/
+};
+
+enum eaio_engine {
+	EAIO_ENGINE_LIBAIO = 0,	/*io_setup/io_submit/io_getevents*/
+	EAIO_ENGINE_URING = 1	/*io_uring, also async for buffered I/O*/
+};
+
+/*token bucket, see eaio_limit*/
+struct eaio_tbucket {
+	uint64_t rate;	/*tokens per second, 0 for no limit*/
+	int64_t burst;
+	int64_t tokens;	/*may go negative, a large request borrows from the future*/
+	uint64_t stamp;
+};
+
+struct eaio_limiter {
+	struct eaio_tbucket iops;
+	struct eaio_tbucket bps;
+};
+
+struct eaio_engine_ops;
+struct eaio_sched_ops;
+struct eaio_merge;
+struct eaio_task;
+struct eaio_executor;
+struct eaio_filter;
+
 struct eaio_queue {
 	int i_efd;
 	int o_efd;
-	struct list_head waiting[EAIO_PRIO_MAX];
-	pthread_mutex_t mutex;
+	int t_fd;	/*timerfd waking the executor when a limit allows more*/
+	struct mpsc_queue inbox;	/*filled by any thread*/
+	struct list_head waiting[EAIO_PRIO_MAX];	/*owned by the executor*/
+	struct list_head ordered;	/*every drained task until done, in queue order*/
+	struct list_head timed;	/*the drained ones with a deadline*/
+	uint64_t t_armed;	/*absolute expiry t_fd is set to, 0 when idle*/
+	uint64_t next_id;	/*atomic, tags of the queue*/
+
+	int inflight;	/*atomic, changed only by the owning executor*/
+	int depth;	/*engine entries, upper bound of allowed*/
+	int allowed;	/*inflight cap, moves between 1 and depth when adaptive*/
+	struct eaio_task **dispatch;	/*depth entries, the tasks of one dispatch round*/
+	struct iocb **iocbp;	/*depth entries, their iocbs after merging*/
+
+	/*adaptive depth, see eaio_qattr.target_lat*/
+	uint64_t target_ns;
+	uint64_t lat_sum;
+	int lat_cnt;
+	bool limited;	/*some task waited on allowed during this window*/
+
+	/*class scheduling, see eaio_qattr*/
+	const struct eaio_sched_ops *sched;
+	uint64_t expire_ns[EAIO_PRIO_MAX];
+	int64_t quantum[EAIO_PRIO_MAX];
+	int64_t deficit[EAIO_PRIO_MAX];
+	int drr_cur;
+	bool drr_fresh;
+
+	bool merge;
+	struct eaio_merge *mfree;
 
-	int inflight;
-	io_context_t context;
+	/*the queue's tasks come from slabs on its node, recycled through tfree*/
+	pthread_spinlock_t tlock;
+	struct eaio_task *tfree;
+	struct eaio_tslab *tslabs;
+
+	/*applied before io_submit, the whole queue first then each class*/
+	struct eaio_limiter limit;
+	struct eaio_limiter plimit[EAIO_PRIO_MAX];
+
+	const struct eaio_engine_ops *ops;
+	io_context_t context;	/*EAIO_ENGINE_LIBAIO*/
+	bool ring;	/*its completions are read off the mmapped ring, see eaio_attr.spin_us*/
+	void *uring;		/*EAIO_ENGINE_URING*/
+
+	struct eaio_qstats stats;	/*written by the executor, read with eaio_context_stats()*/
+	struct eaio_trace *trace;	/*NULL unless eaio_qattr.trace_size*/
+	int node;	/*NUMA node it is bound to, -1 for none*/
 };
 
 struct eaio_context {
 	int qcnts;
 	struct eaio_queue *qslot;
+
+	int epfd;	/*every i_efd and o_efd, keyed by queue*/
+
+	int ecnts;
+	struct eaio_executor *eslot;	/*set by eaio_context_start()*/
+	uint64_t spin_ns;	/*see eaio_attr.spin_us*/
+
+	struct eaio_filter *filters;	/*top of the eaio_context_rdwt() layers, see eaio_filter.h*/
+
+	int nlocal;
+	int *local;	/*per cpu, the queue EAIO_QNUM_LOCAL means there*/
+};
+
+
+struct eaio_limit {
+	uint64_t iops;	/*0 for no limit*/
+	uint64_t bps;	/*bytes per second, 0 for no limit*/
+};
+
+struct eaio_qattr {
+	int depth;	/*engine entries and max inflight, 0 for the default 512*/
+	int target_lat;	/*usec, >0 adapts the allowed inflight to keep completion latency near it*/
+
+	enum eaio_sched sched;
+	int weight[EAIO_PRIO_MAX];	/*EAIO_SCHED_DRR share per class, 0 for EAIO_PRIO_MAX - prio*/
+	/*
+	 * usec a request of the class may wait before it is dispatched ahead of any
+	 * policy order, 0 for no deadline; the earliest expired request goes first.
+	 * A request with a timeout of its own, see eaio_context_rdwt_timed(), is
+	 * also promoted that way once it has waited 3/4 of that timeout.
+	 */
+	int expire[EAIO_PRIO_MAX];
+
+	/*token buckets refilled at the given rates with 100ms of burst*/
+	struct eaio_limit limit;	/*whole queue*/
+	struct eaio_limit plimit[EAIO_PRIO_MAX];	/*per class, on top of limit*/
+
+	/*
+	 * Sort each dispatch round by (fd, offset) and send adjacent reads or writes
+	 * as one vectored iocb, the result is split back to every request.
+	 */
+	bool merge;
+
+	/*records kept in the lifecycle trace ring of the queue, 0 for no tracing*/
+	int trace_size;
+
+	/*
+	 * Bind the queue to NUMA node: its engine rings, trace and the tasks of
+	 * its requests are allocated there, and the executor serving it runs on the
+	 * node's cpus unless eaio_context_start() is given cpus. Only the tasks of
+	 * eaio_context_rdwt_batch() come from the heap. See eaio_numa.h for the node
+	 * of a device.
+	 */
+	bool numa;
+	int node;
 };
 
+struct eaio_attr {
+	enum eaio_engine engine;
+	const struct eaio_qattr *qattr;	/*one entry per queue, NULL for the defaults*/
+	/*
+	 * usec an executor thread, or the caller of eaio_context_exec(), keeps
+	 * polling its queues for completions after the last piece of work before it
+	 * sleeps in epoll_wait() again, 0 never spins. Burns a cpu per executor
+	 * while requests are inflight. Set, the libaio completions are also read
+	 * straight off the ring io_setup() maps rather than with io_getevents().
+	 */
+	int spin_us;
+};
+
+/*
+ * Pass as qnum to use the queue local to the calling cpu: one bound to its NUMA
+ * node when there is any, the cpus of a node spread over its queues.
+ */
+#define EAIO_QNUM_LOCAL (-1)
 
 int eaio_context_init(struct eaio_context *aio_ctx, int qmax);
 
+/*attr may be NULL for the defaults, which is what eaio_context_init() uses*/
+int eaio_context_init_attr(struct eaio_context *aio_ctx, int qmax, const struct eaio_attr *attr);
+
 /*confirm no task left before call this function*/
 int eaio_context_exit(struct eaio_context *aio_ctx);
 
 int eaio_context_exec(struct eaio_context *aio_ctx);
 
+/*
+ * Serve the queues from nthreads executor threads instead of eaio_context_exec():
+ * queue i belongs to thread i % nthreads, and thread j is pinned to cpus[j]
+ * when cpus is given and that entry is not negative, else to the cpus of the
+ * NUMA node of queue j when it is bound to one.
+ * Do not call eaio_context_exec() between start and stop.
+ */
+int eaio_context_start(struct eaio_context *aio_ctx, int nthreads, const int *cpus);
+
+int eaio_context_stop(struct eaio_context *aio_ctx);
+
+/*
+ * A queue bound to node for the calling cpu, e.g. node is eaio_numa_fd_node()
+ * of the device about to be read; the EAIO_QNUM_LOCAL one when node is
+ * negative or no queue is bound to it.
+ */
+int eaio_context_local_queue(struct eaio_context *aio_ctx, int node);
+
+/*
+ * Snapshot the counters and histograms of queue qnum, or the sum of all queues
+ * when qnum is negative; safe to call from any thread while the queues run.
+ */
+int eaio_context_stats(struct eaio_context *aio_ctx, int qnum, struct eaio_qstats *stats);
+
+/*
+ * Write the trace ring of queue qnum as a timeline, oldest event first.
+ * Return the number of events written, or -1 if the queue is not traced.
+ */
+int eaio_context_trace_dump(struct eaio_context *aio_ctx, int qnum, FILE *fp, enum eaio_trace_format format);
+
+/*
+ * efd is the calling thread's reusable eventfd (see eventfd_local()),
+ * the hook must consume its counter, e.g. with eventfd_xrecv(), before returning.
+ */
 typedef void (*eaio_watch_fcb_t)(int efd, void *usr);
 
+/*result is the byte count on success or -errno on failure*/
+typedef void (*eaio_done_fcb_t)(int result, void *usr);
+
 int eaio_context_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
 		int fd, void *buf, size_t count, off_t offset,
 		eaio_watch_fcb_t fcb, void *usr);
+
+/*
+ * Drop what the filters hold of fd in [offset, offset + len), len 0 for the
+ * whole file. Needed after fd is written other than through this context, or
+ * before its number is reused for another file.
+ */
+void eaio_context_invalidate(struct eaio_context *aio_ctx, int fd, off_t offset, size_t len);
+
+/*
+ * Write out what the filters hold back of fd, or of every fd when fd is
+ * negative, before it returns; nothing is synced, queue an EAIO_OPT_FSYNC for that.
+ * Return 0, or -1 with errno set by the first write that failed.
+ */
+int eaio_flush(struct eaio_context *aio_ctx, int fd);
+
+/*
+ * Like eaio_context_rdwt(), but fails with ETIMEDOUT once timeout msec have
+ * passed since the call. A request still waiting in the queue fails at that
+ * moment; one already handed to the kernel is cancelled where the engine can,
+ * and fails when the kernel gives the buffer back, never earlier. Still waiting
+ * with a quarter of the timeout left, it is dispatched ahead of its class order.
+ */
+int eaio_context_rdwt_timed(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_watch_fcb_t fcb, void *usr);
+
+/*
+ * Queue the request and return at once, done() is called later from the thread
+ * running eaio_context_exec(), or before it returns when a filter serves it; buf
+ * must stay valid until then.
+ * Return 0 on success, or -1 with errno set when done() will not be called.
+ */
+int eaio_context_submit(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset,
+		eaio_done_fcb_t done, void *usr);
+
+/*handle of a request for eaio_context_cancel(), the low bits are its queue*/
+typedef uint64_t eaio_tag_t;
+#define EAIO_TAG_QNUM_BITS 16
+
+/*
+ * Like eaio_context_submit(), with a deadline of timeout msec (0 for none) as in
+ * eaio_context_rdwt_timed(); tag, when not NULL, receives the request's handle,
+ * 0 when a filter kept the request from the queues.
+ */
+int eaio_context_submit_timed(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset, int timeout,
+		eaio_done_fcb_t done, void *usr, eaio_tag_t *tag);
+
+/*
+ * Fail the request with ECANCELED, the same way a deadline does; done() is still
+ * called once. A no-op if it already completed. Return 0 once the cancel is
+ * queued, or -1 with errno set.
+ */
+int eaio_context_cancel(struct eaio_context *aio_ctx, eaio_tag_t tag);
+
+struct eaio_rdwt_vec {
+	enum eaio_opt opt;
+	int fd;
+	void *buf;
+	size_t count;
+	off_t offset;
+
+	int result;	/*byte count or -errno, filled in on return*/
+};
+
+/*
+ * Queue nr requests on one queue under a single lock and a single executor wakeup,
+ * then wait until all of them are done; fcb is called once for the whole batch.
+ * With filters each one goes down the chain on its own, as eaio_context_submit().
+ * Return the number of failed requests, or -1 if the batch could not be queued.
+ */
+int eaio_context_rdwt_batch(struct eaio_context *aio_ctx, int qnum, int prio,
+		struct eaio_rdwt_vec *vec, int nr,
+		eaio_watch_fcb_t fcb, void *usr);
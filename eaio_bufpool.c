@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "eaio_logger.h"
+#include "eaio_bufpool.h"
+#include "eaio_numa.h"
+
+#define EAIO_BUFPOOL_NBUFS      64
+#define EAIO_HUGEPAGE_SIZE      (2UL << 20)
+
+/*one mapping per class, the free buffers are chained through their first word*/
+struct eaio_bufslab {
+	char *base;
+	size_t len;
+	size_t size;	/*buffer size of the class*/
+};
+
+struct eaio_bufshard {
+	pthread_spinlock_t lock;
+	void *free[EAIO_BUFPOOL_CLASSES];
+} __attribute__((aligned(64)));
+
+struct eaio_bufpool {
+	int nclass;
+	size_t align;	/*of the posix_memalign fallback*/
+	struct eaio_bufslab slab[EAIO_BUFPOOL_CLASSES];
+	struct eaio_bufshard shard[EAIO_BUFPOOL_SHARDS];
+};
+
+static __thread int tls_shard = -1;
+static int shard_next = 0;
+
+/*the shard of the calling thread, picked once so a thread keeps hitting the same lock*/
+static inline struct eaio_bufshard *eaio_bufpool_shard(struct eaio_bufpool *pool)
+{
+	if (tls_shard < 0) {
+		tls_shard = __atomic_fetch_add(&shard_next, 1, __ATOMIC_RELAXED) % EAIO_BUFPOOL_SHARDS;
+	}
+	return &pool->shard[tls_shard];
+}
+
+static inline size_t roundup_pow2(size_t x)
+{
+	size_t v = 1;
+	while (v < x) {
+		v <<= 1;
+	}
+	return v;
+}
+
+static int eaio_bufpool_class(struct eaio_bufpool *pool, size_t size)
+{
+	int cls = 0;
+	while ((cls < pool->nclass) && (pool->slab[cls].size < size)) {
+		cls++;
+	}
+	return cls;
+}
+
+/*
+ * hugetlb is cleared once the reserved pages run out, the later slabs go straight to THP.
+ * With a node the pages are faulted in only after the mapping is bound to it.
+ */
+static void *eaio_bufslab_map(size_t len, bool hugepage, bool *hugetlb, int node)
+{
+	void *base = MAP_FAILED;
+
+	if (*hugetlb) {
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | ((node < 0) ? MAP_POPULATE : 0), -1, 0);
+		if (base != MAP_FAILED) {
+			if (node >= 0) {
+				eaio_numa_bind(base, len, node);
+				memset(base, 0, len);
+			}
+			return base;
+		}
+		eaio_printf(LOG_INFO, "no hugetlb pages for %zu bytes, using THP: %m", len);
+		*hugetlb = false;
+	}
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	if (hugepage) {
+		madvise(base, len, MADV_HUGEPAGE);
+	}
+	if (node >= 0) {
+		eaio_numa_bind(base, len, node);
+	}
+	/*fault everything in now, not on the io path*/
+	memset(base, 0, len);
+	return base;
+}
+
+struct eaio_bufpool *eaio_bufpool_create(const struct eaio_bufpool_attr *attr)
+{
+	size_t pagesize = getpagesize();
+	size_t min_size = (attr && attr->min_size) ? attr->min_size : pagesize;
+	size_t max_size = (attr && attr->max_size) ? attr->max_size : (1UL << 20);
+	int nbufs = (attr && (attr->nbufs > 0)) ? attr->nbufs : EAIO_BUFPOOL_NBUFS;
+	bool hugepage = attr ? attr->hugepage : false;
+	bool hugetlb = hugepage;
+	int node = (attr && attr->numa) ? attr->node : -1;
+
+	min_size = roundup_pow2(min_size < 512 ? 512 : min_size);
+	max_size = roundup_pow2(max_size < min_size ? min_size : max_size);
+
+	struct eaio_bufpool *pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->align = (min_size < pagesize) ? pagesize : min_size;
+
+	for (size_t size = min_size; (size <= max_size) && (pool->nclass < EAIO_BUFPOOL_CLASSES); size <<= 1) {
+		struct eaio_bufslab *slab = &pool->slab[pool->nclass];
+		size_t unit = hugepage ? EAIO_HUGEPAGE_SIZE : pagesize;
+
+		slab->size = size;
+		slab->len = (size * nbufs + unit - 1) / unit * unit;
+		slab->base = eaio_bufslab_map(slab->len, hugepage, &hugetlb, node);
+		if (!slab->base) {
+			eaio_printf(LOG_ERR, "mmap %zu bytes failed: %m", slab->len);
+			eaio_bufpool_destroy(pool);
+			return NULL;
+		}
+		pool->nclass++;
+	}
+	if (max_size > pool->slab[pool->nclass - 1].size) {
+		eaio_printf(LOG_WARNING, "bufpool classes stop at %zu bytes", pool->slab[pool->nclass - 1].size);
+	}
+
+	for (int i = 0; i < EAIO_BUFPOOL_SHARDS; i++) {
+		pthread_spin_init(&pool->shard[i].lock, PTHREAD_PROCESS_PRIVATE);
+	}
+	/*deal the buffers out to the shards, the rounding slack included*/
+	for (int cls = 0; cls < pool->nclass; cls++) {
+		struct eaio_bufslab *slab = &pool->slab[cls];
+		size_t count = slab->len / slab->size;
+
+		for (size_t i = 0; i < count; i++) {
+			void **buf = (void **)(slab->base + i * slab->size);
+			struct eaio_bufshard *shard = &pool->shard[i % EAIO_BUFPOOL_SHARDS];
+
+			*buf = shard->free[cls];
+			shard->free[cls] = buf;
+		}
+	}
+	return pool;
+}
+
+void eaio_bufpool_destroy(struct eaio_bufpool *pool)
+{
+	if (!pool) {
+		return;
+	}
+	for (int cls = 0; cls < pool->nclass; cls++) {
+		munmap(pool->slab[cls].base, pool->slab[cls].len);
+	}
+	for (int i = 0; i < EAIO_BUFPOOL_SHARDS; i++) {
+		pthread_spin_destroy(&pool->shard[i].lock);
+	}
+	free(pool);
+}
+
+static void *eaio_bufshard_pop(struct eaio_bufshard *shard, int cls)
+{
+	pthread_spin_lock(&shard->lock);
+	void **buf = shard->free[cls];
+	if (buf) {
+		shard->free[cls] = *buf;
+	}
+	pthread_spin_unlock(&shard->lock);
+	return buf;
+}
+
+void *eaio_bufpool_alloc(struct eaio_bufpool *pool, size_t size)
+{
+	int cls = eaio_bufpool_class(pool, size);
+
+	if (cls < pool->nclass) {
+		struct eaio_bufshard *shard = eaio_bufpool_shard(pool);
+		void *buf = eaio_bufshard_pop(shard, cls);
+		if (buf) {
+			return buf;
+		}
+		/*steal from the neighbours before giving up*/
+		for (int i = 1; i < EAIO_BUFPOOL_SHARDS; i++) {
+			int idx = (shard - pool->shard + i) % EAIO_BUFPOOL_SHARDS;
+			buf = eaio_bufshard_pop(&pool->shard[idx], cls);
+			if (buf) {
+				return buf;
+			}
+		}
+	}
+
+	void *buf = NULL;
+	int err = posix_memalign(&buf, pool->align, size ? size : 1);
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+	return buf;
+}
+
+static int eaio_bufpool_owner(struct eaio_bufpool *pool, void *buf)
+{
+	for (int cls = 0; cls < pool->nclass; cls++) {
+		struct eaio_bufslab *slab = &pool->slab[cls];
+		if (((char *)buf >= slab->base) && ((char *)buf < slab->base + slab->len)) {
+			return cls;
+		}
+	}
+	return -1;
+}
+
+void eaio_bufpool_free(struct eaio_bufpool *pool, void *buf)
+{
+	if (!buf) {
+		return;
+	}
+	int cls = eaio_bufpool_owner(pool, buf);
+	if (cls < 0) {
+		free(buf);
+		return;
+	}
+	assert((((char *)buf - pool->slab[cls].base) % pool->slab[cls].size) == 0);
+
+	struct eaio_bufshard *shard = eaio_bufpool_shard(pool);
+	pthread_spin_lock(&shard->lock);
+	*(void **)buf = shard->free[cls];
+	shard->free[cls] = buf;
+	pthread_spin_unlock(&shard->lock);
+}
+
+size_t eaio_bufpool_size(struct eaio_bufpool *pool, void *buf)
+{
+	int cls = eaio_bufpool_owner(pool, buf);
+	return (cls < 0) ? 0 : pool->slab[cls].size;
+}
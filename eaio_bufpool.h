@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define EAIO_BUFPOOL_CLASSES    16	/*power of two size classes between min_size and max_size*/
+#define EAIO_BUFPOOL_SHARDS     16	/*threads are spread over the shards round robin*/
+
+struct eaio_bufpool_attr {
+	size_t min_size;	/*smallest class, power of two, default is the page size*/
+	size_t max_size;	/*largest class, larger requests fall back to posix_memalign*/
+	int nbufs;	/*buffers preallocated per class, default is 64*/
+	bool hugepage;	/*back the slabs with 2MB pages, THP is tried when none are reserved*/
+	bool numa;	/*put the slabs on NUMA node, e.g. that of the queues using them*/
+	int node;
+};
+
+struct eaio_bufpool;
+
+/*
+ * Every buffer is aligned to its class size or to the page size, whichever is
+ * smaller, so O_DIRECT works on any device with a logical block of min_size.
+ */
+struct eaio_bufpool *eaio_bufpool_create(const struct eaio_bufpool_attr *attr);
+
+/*all buffers must have been freed*/
+void eaio_bufpool_destroy(struct eaio_bufpool *pool);
+
+/*
+ * Returns a buffer of at least size bytes, or NULL.
+ * When the class is used up the buffer comes from posix_memalign instead.
+ */
+void *eaio_bufpool_alloc(struct eaio_bufpool *pool, size_t size);
+
+void eaio_bufpool_free(struct eaio_bufpool *pool, void *buf);
+
+/*usable size of a buffer from eaio_bufpool_alloc, 0 for one not from the slabs*/
+size_t eaio_bufpool_size(struct eaio_bufpool *pool, void *buf);
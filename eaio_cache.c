@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "list.h"
+#include "eaio_logger.h"
+#include "eaio_filter.h"
+#include "eaio_cache.h"
+
+#define EAIO_CACHE_CAPACITY     (64UL << 20)
+#define EAIO_CACHE_BLOCK        4096
+#define EAIO_CACHE_SHARDS       16
+#define EAIO_CACHE_MAX_FILL     (256UL << 10)
+
+enum eaio_cache_where {
+	EAIO_CACHE_FREE = 0,
+	EAIO_CACHE_A1IN = 1,	/*seen once, FIFO*/
+	EAIO_CACHE_AM = 2	/*seen again after leaving A1in, LRU*/
+};
+
+struct eaio_cblock {
+	struct hlist_node hnode;
+	struct list_node lnode;	/*on free, a1in or am*/
+	enum eaio_cache_where where;
+	int fd;
+	uint64_t blk;
+	size_t valid;	/*bytes of the file in it, less than a block at the end*/
+	char *data;
+};
+
+/*key of a block evicted from A1in, a miss on it goes straight to Am*/
+struct eaio_cghost {
+	struct hlist_node hnode;
+	struct list_node lnode;	/*on a1out or gfree*/
+	int fd;
+	uint64_t blk;
+};
+
+/*
+ * 2Q as in Johnson & Shasha: kin blocks at most in A1in while Am has any,
+ * the keys of the last kout ones pushed out of A1in are remembered in A1out.
+ */
+struct eaio_cshard {
+	pthread_mutex_t lock;
+	uint64_t hmask;
+	struct hlist_head *hash;	/*blocks*/
+	struct hlist_head *ghash;	/*ghosts*/
+
+	struct list_head free;
+	struct list_head a1in;
+	struct list_head am;
+	struct list_head a1out;
+	struct list_head gfree;
+	int nin;
+	int kin;
+
+	/*
+	 * Ticked under lock by every invalidation reaching the shard, which stamps the
+	 * hash buckets of the blocks it drops, or all when it looks at every block.
+	 */
+	uint64_t clock;
+	uint64_t *stamp;
+	uint64_t all;
+} __attribute__((aligned(64)));
+
+struct eaio_cache {
+	struct eaio_filter filter;
+	size_t block;
+	int shift;
+	size_t max_fill;
+
+	char *arena;
+	size_t arena_len;
+	size_t per;	/*blocks of a shard, blocks[i * per] on are shard i's for good*/
+	struct eaio_cblock *blocks;
+	struct eaio_cghost *ghosts;
+	struct hlist_head *buckets;
+	uint64_t *stamps;
+
+	struct eaio_cache_stats stats;	/*atomic*/
+	int nshards;
+	struct eaio_cshard shards[0];
+};
+
+static inline uint64_t eaio_cache_hash(int fd, uint64_t blk)
+{
+	uint64_t h = ((uint64_t)fd * 0x9e3779b97f4a7c15ULL) ^ (blk * 0xc2b2ae3d27d4eb4fULL);
+	return h ^ (h >> 29);
+}
+
+static inline struct eaio_cshard *eaio_cache_shard(struct eaio_cache *cache, int fd, uint64_t blk)
+{
+	return &cache->shards[(eaio_cache_hash(fd, blk) >> 40) % cache->nshards];
+}
+
+static inline void eaio_cache_count(uint64_t *p, uint64_t v)
+{
+	__atomic_add_fetch(p, v, __ATOMIC_RELAXED);
+}
+
+static struct eaio_cblock *eaio_cache_find(struct eaio_cshard *sh, int fd, uint64_t blk)
+{
+	struct eaio_cblock *b;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(b, pos, &sh->hash[eaio_cache_hash(fd, blk) & sh->hmask], hnode) {
+		if ((b->fd == fd) && (b->blk == blk)) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static struct eaio_cghost *eaio_cache_ghost(struct eaio_cshard *sh, int fd, uint64_t blk)
+{
+	struct eaio_cghost *g;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(g, pos, &sh->ghash[eaio_cache_hash(fd, blk) & sh->hmask], hnode) {
+		if ((g->fd == fd) && (g->blk == blk)) {
+			return g;
+		}
+	}
+	return NULL;
+}
+
+static void eaio_cache_unlink(struct eaio_cshard *sh, struct eaio_cblock *b)
+{
+	hlist_del(&b->hnode);
+	list_del(&b->lnode);
+	if (b->where == EAIO_CACHE_A1IN) {
+		sh->nin--;
+	}
+	b->where = EAIO_CACHE_FREE;
+}
+
+static void eaio_cache_remember(struct eaio_cshard *sh, int fd, uint64_t blk)
+{
+	struct eaio_cghost *g;
+
+	if (!list_empty(&sh->gfree)) {
+		g = list_first_entry(&sh->gfree, struct eaio_cghost, lnode);
+	} else {
+		/*forget the oldest*/
+		g = list_entry(sh->a1out.n.prev, struct eaio_cghost, lnode);
+		hlist_del(&g->hnode);
+	}
+	list_del(&g->lnode);
+	g->fd = fd;
+	g->blk = blk;
+	hlist_add_head(&g->hnode, &sh->ghash[eaio_cache_hash(fd, blk) & sh->hmask]);
+	list_add(&g->lnode, &sh->a1out);
+}
+
+static void eaio_cache_forget(struct eaio_cshard *sh, struct eaio_cghost *g)
+{
+	hlist_del(&g->hnode);
+	list_del(&g->lnode);
+	list_add(&g->lnode, &sh->gfree);
+}
+
+/*a free block, evicting one when there is none*/
+static struct eaio_cblock *eaio_cache_reclaim(struct eaio_cache *cache, struct eaio_cshard *sh)
+{
+	struct eaio_cblock *b;
+
+	if (!list_empty(&sh->free)) {
+		b = list_first_entry(&sh->free, struct eaio_cblock, lnode);
+		list_del(&b->lnode);
+		return b;
+	}
+	if ((sh->nin > sh->kin) || list_empty(&sh->am)) {
+		b = list_entry(sh->a1in.n.prev, struct eaio_cblock, lnode);
+		eaio_cache_remember(sh, b->fd, b->blk);
+	} else {
+		b = list_entry(sh->am.n.prev, struct eaio_cblock, lnode);
+	}
+	eaio_cache_unlink(sh, b);
+	eaio_cache_count(&cache->stats.evictions, 1);
+	return b;
+}
+
+/*the clock of every shard, taken before a fill's read is issued*/
+static void eaio_cache_snap(struct eaio_cache *cache, uint64_t *gens)
+{
+	for (int i = 0; i < cache->nshards; i++) {
+		gens[i] = __atomic_load_n(&cache->shards[i].clock, __ATOMIC_ACQUIRE);
+	}
+}
+
+/*
+ * gens is what the shards' clocks were at before the data was read; checked under
+ * the shard lock, an invalidation of the block either is seen here or drops it
+ * right after. Only those sharing its hash bucket are mistaken for it.
+ */
+static void eaio_cache_insert(struct eaio_cache *cache, int fd, uint64_t blk, const char *data, size_t valid,
+		const uint64_t *gens)
+{
+	struct eaio_cshard *sh = eaio_cache_shard(cache, fd, blk);
+
+	uint64_t gen = gens[sh - cache->shards];
+	pthread_mutex_lock(&sh->lock);
+	if ((sh->all > gen) || (sh->stamp[eaio_cache_hash(fd, blk) & sh->hmask] > gen)) {
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
+	struct eaio_cblock *b = eaio_cache_find(sh, fd, blk);
+	if (b) {
+		/*read again after a partial hit, the new copy is as good*/
+		memcpy(b->data, data, valid);
+		b->valid = valid;
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
+
+	b = eaio_cache_reclaim(cache, sh);
+	b->fd = fd;
+	b->blk = blk;
+	b->valid = valid;
+	memcpy(b->data, data, valid);
+	hlist_add_head(&b->hnode, &sh->hash[eaio_cache_hash(fd, blk) & sh->hmask]);
+
+	struct eaio_cghost *g = eaio_cache_ghost(sh, fd, blk);
+	if (g) {
+		eaio_cache_forget(sh, g);
+		b->where = EAIO_CACHE_AM;
+		list_add(&b->lnode, &sh->am);
+	} else {
+		b->where = EAIO_CACHE_A1IN;
+		list_add(&b->lnode, &sh->a1in);
+		sh->nin++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	eaio_cache_count(&cache->stats.fills, 1);
+}
+
+/*keep the ret bytes read into data from block first on*/
+static void eaio_cache_fill(struct eaio_cache *cache, int fd, uint64_t first, uint64_t last,
+		const char *data, int ret, const uint64_t *gens)
+{
+	for (uint64_t blk = first; blk <= last; blk++) {
+		size_t skip = (blk - first) << cache->shift;
+		if ((size_t)ret <= skip) {
+			break;
+		}
+		size_t valid = ret - skip;
+		eaio_cache_insert(cache, fd, blk, data + skip,
+				(valid < cache->block) ? valid : cache->block, gens);
+	}
+}
+
+/*copy what the cache has of the range into out, false as soon as a piece is missing*/
+static bool eaio_cache_lookup(struct eaio_cache *cache, int fd, char *out, off_t offset, size_t count)
+{
+	off_t end = offset + count;
+
+	for (off_t at = offset; at < end;) {
+		uint64_t blk = at >> cache->shift;
+		off_t base = blk << cache->shift;
+		off_t stop = base + cache->block;
+		size_t n = ((stop < end) ? stop : end) - at;
+		struct eaio_cshard *sh = eaio_cache_shard(cache, fd, blk);
+
+		pthread_mutex_lock(&sh->lock);
+		struct eaio_cblock *b = eaio_cache_find(sh, fd, blk);
+		/*the file may have grown past a short block since*/
+		if (!b || (at - base + n > b->valid)) {
+			pthread_mutex_unlock(&sh->lock);
+			return false;
+		}
+		memcpy(out + (at - offset), b->data + (at - base), n);
+		if (b->where == EAIO_CACHE_AM) {
+			list_move(&b->lnode, &sh->am);
+		}
+		pthread_mutex_unlock(&sh->lock);
+		at += n;
+	}
+	return true;
+}
+
+static void eaio_cache_invalidate(struct eaio_filter *flt, int fd, off_t offset, size_t len)
+{
+	struct eaio_cache *cache = container_of(flt, struct eaio_cache, filter);
+
+	uint64_t first = len ? (offset >> cache->shift) : 0;
+	uint64_t last = len ? ((offset + len - 1) >> cache->shift) : UINT64_MAX;
+	if (len && (last - first < cache->per * cache->nshards)) {
+		for (uint64_t blk = first; blk <= last; blk++) {
+			struct eaio_cshard *sh = eaio_cache_shard(cache, fd, blk);
+
+			pthread_mutex_lock(&sh->lock);
+			/*fills that read before this must not land after it*/
+			sh->stamp[eaio_cache_hash(fd, blk) & sh->hmask] =
+				__atomic_add_fetch(&sh->clock, 1, __ATOMIC_RELEASE);
+			struct eaio_cblock *b = eaio_cache_find(sh, fd, blk);
+			if (b) {
+				eaio_cache_unlink(sh, b);
+				list_add(&b->lnode, &sh->free);
+			}
+			pthread_mutex_unlock(&sh->lock);
+		}
+		return;
+	}
+
+	/*whole file or a range wider than the cache, look at every block instead*/
+	for (int i = 0; i < cache->nshards; i++) {
+		struct eaio_cshard *sh = &cache->shards[i];
+
+		pthread_mutex_lock(&sh->lock);
+		sh->all = __atomic_add_fetch(&sh->clock, 1, __ATOMIC_RELEASE);
+		for (size_t j = 0; j < cache->per; j++) {
+			struct eaio_cblock *b = &cache->blocks[i * cache->per + j];
+			if (b->where == EAIO_CACHE_FREE) {
+				continue;
+			}
+			if ((b->fd == fd) && (b->blk >= first) && (b->blk <= last)) {
+				eaio_cache_unlink(sh, b);
+				list_add(&b->lnode, &sh->free);
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+static int eaio_cache_rdwt(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_cache *cache = container_of(flt, struct eaio_cache, filter);
+
+	if (eaio_filter_is_write(req)) {
+		return eaio_filter_write_around(flt, req);
+	}
+	if ((req->opt != EAIO_OPT_PREAD) || !req->count || (req->fd < 0)) {
+		return eaio_filter_next(flt, req);
+	}
+
+	if (eaio_cache_lookup(cache, req->fd, req->buf, req->offset, req->count)) {
+		eaio_cache_count(&cache->stats.hits, 1);
+		return req->count;
+	}
+
+	uint64_t first = req->offset >> cache->shift;
+	uint64_t last = (req->offset + req->count - 1) >> cache->shift;
+	size_t len = (last - first + 1) << cache->shift;
+	if (len > cache->max_fill) {
+		eaio_cache_count(&cache->stats.bypass, 1);
+		return eaio_filter_next(flt, req);
+	}
+	eaio_cache_count(&cache->stats.misses, 1);
+
+	/*whole blocks, straight into the caller's buffer when the request is exactly them*/
+	struct eaio_filter_req sub = *req;
+	char *data = req->buf;
+	sub.offset = first << cache->shift;
+	sub.count = len;
+	if ((sub.offset != req->offset) || (len != req->count) ||
+		((uintptr_t)req->buf & (getpagesize() - 1))) {
+		if (posix_memalign((void **)&data, getpagesize(), len)) {
+			return eaio_filter_next(flt, req);
+		}
+		sub.buf = data;
+	}
+
+	uint64_t gens[cache->nshards];
+	eaio_cache_snap(cache, gens);
+	int ret = eaio_filter_next(flt, &sub);
+	if (ret < 0) {
+		/*maybe only the widened request is refused, let the original one tell*/
+		if (data != req->buf) {
+			free(data);
+		}
+		return eaio_filter_next(flt, req);
+	}
+
+	eaio_cache_fill(cache, req->fd, first, last, data, ret, gens);
+	if (data == req->buf) {
+		return ret;
+	}
+	size_t skip = req->offset - sub.offset;
+	size_t got = ((size_t)ret > skip) ? (ret - skip) : 0;
+	if (got > req->count) {
+		got = req->count;
+	}
+	memcpy(req->buf, data + skip, got);
+	free(data);
+	return got;
+}
+
+/*a submitted miss, reading whole blocks below*/
+struct eaio_cache_miss {
+	struct eaio_cache *cache;
+	struct eaio_filter_req req;	/*the caller's*/
+	char *data;	/*the blocks, req.buf when the request is exactly them*/
+	uint64_t first;
+	uint64_t last;
+	uint64_t gens[0];
+};
+
+static void eaio_cache_filled(int result, void *usr)
+{
+	struct eaio_cache_miss *miss = usr;
+	struct eaio_cache *cache = miss->cache;
+	const struct eaio_filter_req *req = &miss->req;
+
+	if (result < 0) {
+		if (miss->data == req->buf) {
+			req->done(result, req->usr);
+		} else if (eaio_filter_submit_next(&cache->filter, req) < 0) {
+			/*maybe only the widened request is refused, let the original one tell*/
+			req->done(-errno, req->usr);
+		}
+	} else {
+		eaio_cache_fill(cache, req->fd, miss->first, miss->last, miss->data, result, miss->gens);
+		if (miss->data != req->buf) {
+			size_t skip = req->offset - ((off_t)miss->first << cache->shift);
+			size_t got = ((size_t)result > skip) ? (result - skip) : 0;
+			if (got > req->count) {
+				got = req->count;
+			}
+			memcpy(req->buf, miss->data + skip, got);
+			result = got;
+		}
+		req->done(result, req->usr);
+	}
+
+	if (miss->data != req->buf) {
+		free(miss->data);
+	}
+	free(miss);
+}
+
+static int eaio_cache_submit(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_cache *cache = container_of(flt, struct eaio_cache, filter);
+
+	if (eaio_filter_is_write(req)) {
+		/*dropped again once it is done, see eaio_filters_submit()*/
+		size_t len = eaio_filter_req_len(req);
+		eaio_cache_invalidate(flt, req->fd, req->offset, len ? len : 1);
+		return eaio_filter_submit_next(flt, req);
+	}
+	if ((req->opt != EAIO_OPT_PREAD) || !req->count || (req->fd < 0)) {
+		return eaio_filter_submit_next(flt, req);
+	}
+
+	if (eaio_cache_lookup(cache, req->fd, req->buf, req->offset, req->count)) {
+		eaio_cache_count(&cache->stats.hits, 1);
+		req->done(req->count, req->usr);
+		return 0;
+	}
+
+	uint64_t first = req->offset >> cache->shift;
+	uint64_t last = (req->offset + req->count - 1) >> cache->shift;
+	size_t len = (last - first + 1) << cache->shift;
+	if (len > cache->max_fill) {
+		eaio_cache_count(&cache->stats.bypass, 1);
+		return eaio_filter_submit_next(flt, req);
+	}
+
+	struct eaio_cache_miss *miss = malloc(sizeof(*miss) + cache->nshards * sizeof(uint64_t));
+	if (!miss) {
+		return eaio_filter_submit_next(flt, req);
+	}
+	miss->cache = cache;
+	miss->req = *req;
+	miss->first = first;
+	miss->last = last;
+	miss->data = req->buf;
+
+	struct eaio_filter_req sub = *req;
+	sub.offset = first << cache->shift;
+	sub.count = len;
+	if ((sub.offset != req->offset) || (len != req->count) ||
+		((uintptr_t)req->buf & (getpagesize() - 1))) {
+		if (posix_memalign((void **)&miss->data, getpagesize(), len)) {
+			free(miss);
+			return eaio_filter_submit_next(flt, req);
+		}
+		sub.buf = miss->data;
+	}
+	sub.done = eaio_cache_filled;
+	sub.usr = miss;
+	eaio_cache_count(&cache->stats.misses, 1);
+
+	eaio_cache_snap(cache, miss->gens);
+	if (eaio_filter_submit_next(flt, &sub) < 0) {
+		if (miss->data != req->buf) {
+			free(miss->data);
+		}
+		free(miss);
+		return eaio_filter_submit_next(flt, req);
+	}
+	return 0;
+}
+
+static const struct eaio_filter_ops eaio_cache_ops = {
+	.name = "cache",
+	.rdwt = eaio_cache_rdwt,
+	.submit = eaio_cache_submit,
+	.invalidate = eaio_cache_invalidate,
+};
+
+struct eaio_cache *eaio_cache_create(struct eaio_context *aio_ctx, const struct eaio_cache_attr *attr)
+{
+	int nshards = (attr && (attr->shards > 0)) ? attr->shards : EAIO_CACHE_SHARDS;
+	size_t block = (attr && attr->block) ? attr->block : EAIO_CACHE_BLOCK;
+	size_t capacity = (attr && attr->capacity) ? attr->capacity : EAIO_CACHE_CAPACITY;
+
+	if (block & (block - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/*at least two blocks a shard, A1in and Am*/
+	size_t per = capacity / block / nshards;
+	if (per < 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t nblocks = per * nshards;
+	uint64_t nbuckets = 1;
+	while (nbuckets < per) {
+		nbuckets <<= 1;
+	}
+
+	struct eaio_cache *cache = calloc(1, sizeof(*cache) + nshards * sizeof(struct eaio_cshard));
+	if (!cache) {
+		return NULL;
+	}
+	cache->block = block;
+	cache->shift = __builtin_ctzl(block);
+	cache->max_fill = (attr && attr->max_fill) ? attr->max_fill : EAIO_CACHE_MAX_FILL;
+	cache->nshards = nshards;
+	cache->per = per;
+	cache->arena_len = nblocks * block;
+	cache->arena = mmap(NULL, cache->arena_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	cache->blocks = calloc(nblocks, sizeof(struct eaio_cblock));
+	cache->ghosts = calloc(nblocks / 2 + nshards, sizeof(struct eaio_cghost));
+	cache->buckets = calloc(2 * nbuckets * nshards, sizeof(struct hlist_head));
+	cache->stamps = calloc(nbuckets * nshards, sizeof(uint64_t));
+	if ((cache->arena == MAP_FAILED) || !cache->blocks || !cache->ghosts || !cache->buckets ||
+		!cache->stamps) {
+		eaio_printf(LOG_ERR, "no memory for a cache of %zu bytes", cache->arena_len);
+		if (cache->arena != MAP_FAILED) {
+			munmap(cache->arena, cache->arena_len);
+		}
+		free(cache->blocks);
+		free(cache->ghosts);
+		free(cache->buckets);
+		free(cache->stamps);
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t kout = per / 2 ? per / 2 : 1;
+	for (int i = 0; i < nshards; i++) {
+		struct eaio_cshard *sh = &cache->shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->hmask = nbuckets - 1;
+		sh->hash = &cache->buckets[2 * nbuckets * i];
+		sh->ghash = sh->hash + nbuckets;
+		sh->stamp = &cache->stamps[nbuckets * i];
+		INIT_LIST_HEAD(&sh->free);
+		INIT_LIST_HEAD(&sh->a1in);
+		INIT_LIST_HEAD(&sh->am);
+		INIT_LIST_HEAD(&sh->a1out);
+		INIT_LIST_HEAD(&sh->gfree);
+		sh->nin = 0;
+		sh->kin = per / 4 ? per / 4 : 1;
+
+		for (size_t j = 0; j < per; j++) {
+			struct eaio_cblock *b = &cache->blocks[i * per + j];
+			b->data = cache->arena + (i * per + j) * block;
+			b->where = EAIO_CACHE_FREE;
+			list_add_tail(&b->lnode, &sh->free);
+		}
+		for (size_t j = 0; j < kout; j++) {
+			struct eaio_cghost *g = &cache->ghosts[i * kout + j];
+			list_add_tail(&g->lnode, &sh->gfree);
+		}
+	}
+
+	eaio_context_push_filter(aio_ctx, &cache->filter, &eaio_cache_ops);
+	return cache;
+}
+
+void eaio_cache_destroy(struct eaio_cache *cache)
+{
+	eaio_context_remove_filter(cache->filter.aio_ctx, &cache->filter);
+
+	for (int i = 0; i < cache->nshards; i++) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+	}
+	munmap(cache->arena, cache->arena_len);
+	free(cache->blocks);
+	free(cache->ghosts);
+	free(cache->buckets);
+	free(cache->stamps);
+	free(cache);
+}
+
+void eaio_cache_stats(struct eaio_cache *cache, struct eaio_cache_stats *stats)
+{
+	stats->hits = __atomic_load_n(&cache->stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&cache->stats.misses, __ATOMIC_RELAXED);
+	stats->bypass = __atomic_load_n(&cache->stats.bypass, __ATOMIC_RELAXED);
+	stats->fills = __atomic_load_n(&cache->stats.fills, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&cache->stats.evictions, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eaio_api.h"
+
+struct eaio_cache_attr {
+	size_t capacity;	/*bytes of block memory, never exceeded, default 64MB*/
+	size_t block;	/*power of two, default 4096; keep it a multiple of the O_DIRECT alignment*/
+	int shards;	/*default 16*/
+	size_t max_fill;	/*reads spanning more blocks than this pass uncached, default 256KB*/
+};
+
+struct eaio_cache_stats {
+	uint64_t hits;	/*reads copied out of the cache*/
+	uint64_t misses;	/*reads that went down and filled it*/
+	uint64_t bypass;	/*reads too large to cache*/
+	uint64_t fills;	/*blocks inserted*/
+	uint64_t evictions;
+};
+
+struct eaio_cache;
+
+/*
+ * Block cache filter on aio_ctx, see eaio_filter.h, for the O_DIRECT readers that
+ * lose the page cache. EAIO_OPT_PREAD calls whose blocks are all cached are copied
+ * out on the calling thread; the others read the whole blocks below and keep them.
+ * Blocks are keyed by (fd, offset / block) and evicted by 2Q, so a scan passes
+ * through a small FIFO without flushing the blocks read more than once.
+ * eaio_context_submit() misses complete once the blocks land, hits before it returns.
+ * Writes through the context drop what they overlap. A fill only gives up the
+ * blocks an invalidation raced with, or a neighbour in the same hash bucket.
+ */
+struct eaio_cache *eaio_cache_create(struct eaio_context *aio_ctx, const struct eaio_cache_attr *attr);
+
+/*after the last request is done*/
+void eaio_cache_destroy(struct eaio_cache *cache);
+
+void eaio_cache_stats(struct eaio_cache *cache, struct eaio_cache_stats *stats);
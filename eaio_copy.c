@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "etask.h"
+#include "eaio_copy.h"
+
+#define EAIO_COPY_BS    (1 << 20)
+#define EAIO_COPY_NBUFS 4
+
+struct eaio_copy;
+
+/*one buffer of the pipeline, it loops read -> write -> read until the range is done*/
+struct eaio_copy_buf {
+	struct eaio_copy *cp;
+	char *data;
+	uint64_t off;	/*from the start of the range*/
+	size_t len;	/*bytes read into data*/
+	size_t done;	/*bytes of len written*/
+};
+
+struct eaio_copy {
+	struct eaio_context *aio_ctx;
+	int rq, rfd;
+	int wq, wfd;
+	off_t roff, woff;
+	size_t bs;
+	int prio;
+
+	/*the callbacks of rq and wq may run on two executors*/
+	pthread_mutex_t lock;
+	uint64_t next;	/*next offset to read*/
+	uint64_t end;	/*lowered when rfd turns out shorter*/
+	uint64_t copied;
+	int error;
+	int active;	/*buffers still going round*/
+	struct ewait wait;
+};
+
+static void eaio_copy_read(struct eaio_copy_buf *buf);
+
+static void eaio_copy_fail(struct eaio_copy_buf *buf, int error)
+{
+	struct eaio_copy *cp = buf->cp;
+
+	pthread_mutex_lock(&cp->lock);
+	if (!cp->error) {
+		cp->error = error;
+	}
+	pthread_mutex_unlock(&cp->lock);
+	/*retires the buffer*/
+	eaio_copy_read(buf);
+}
+
+static void eaio_copy_write_done(int result, void *usr);
+
+static void eaio_copy_write(struct eaio_copy_buf *buf)
+{
+	struct eaio_copy *cp = buf->cp;
+
+	int ret = eaio_context_submit(cp->aio_ctx, EAIO_OPT_PWRITE, cp->wq, cp->prio,
+			cp->wfd, buf->data + buf->done, buf->len - buf->done, cp->woff + buf->off + buf->done,
+			eaio_copy_write_done, buf);
+	if (ret < 0) {
+		eaio_copy_fail(buf, -ENOMEM);
+	}
+}
+
+static void eaio_copy_write_done(int result, void *usr)
+{
+	struct eaio_copy_buf *buf = usr;
+	struct eaio_copy *cp = buf->cp;
+
+	if (result <= 0) {
+		eaio_copy_fail(buf, result ? result : -ENOSPC);
+		return;
+	}
+	buf->done += result;
+	if (buf->done < buf->len) {
+		eaio_copy_write(buf);
+		return;
+	}
+
+	pthread_mutex_lock(&cp->lock);
+	cp->copied += buf->len;
+	pthread_mutex_unlock(&cp->lock);
+	eaio_copy_read(buf);
+}
+
+static void eaio_copy_read_done(int result, void *usr)
+{
+	struct eaio_copy_buf *buf = usr;
+	struct eaio_copy *cp = buf->cp;
+
+	if (result < 0) {
+		eaio_copy_fail(buf, result);
+		return;
+	}
+	if ((size_t)result < buf->len) {
+		/*short read of a file is its end, nothing past it is worth reading*/
+		pthread_mutex_lock(&cp->lock);
+		if (buf->off + result < cp->end) {
+			cp->end = buf->off + result;
+		}
+		pthread_mutex_unlock(&cp->lock);
+		buf->len = result;
+	}
+	if (!buf->len) {
+		eaio_copy_read(buf);
+		return;
+	}
+	buf->done = 0;
+	eaio_copy_write(buf);
+}
+
+static void eaio_copy_read(struct eaio_copy_buf *buf)
+{
+	struct eaio_copy *cp = buf->cp;
+
+	pthread_mutex_lock(&cp->lock);
+	if (cp->error || (cp->next >= cp->end)) {
+		bool last = (--cp->active == 0);
+		pthread_mutex_unlock(&cp->lock);
+		if (last) {
+			ewait_wake(&cp->wait);
+		}
+		return;
+	}
+	buf->off = cp->next;
+	buf->len = (cp->end - cp->next < cp->bs) ? (cp->end - cp->next) : cp->bs;
+	cp->next += buf->len;
+	pthread_mutex_unlock(&cp->lock);
+
+	int ret = eaio_context_submit(cp->aio_ctx, EAIO_OPT_PREAD, cp->rq, cp->prio,
+			cp->rfd, buf->data, buf->len, cp->roff + buf->off,
+			eaio_copy_read_done, buf);
+	if (ret < 0) {
+		eaio_copy_fail(buf, -ENOMEM);
+	}
+}
+
+ssize_t eaio_copy_range(struct eaio_context *aio_ctx,
+		int rq, int rfd, off_t roff,
+		int wq, int wfd, off_t woff,
+		uint64_t len, const struct eaio_copy_attr *attr)
+{
+	struct eaio_copy cp = {
+		.aio_ctx = aio_ctx,
+		.rq = rq,
+		.rfd = rfd,
+		.wq = wq,
+		.wfd = wfd,
+		.roff = roff,
+		.woff = woff,
+		.bs = (attr && attr->bs) ? attr->bs : EAIO_COPY_BS,
+		.prio = attr ? attr->prio : 0,
+		.next = 0,
+		.end = len,
+	};
+	struct eaio_bufpool *pool = attr ? attr->pool : NULL;
+	int nbufs = (attr && (attr->nbufs > 0)) ? attr->nbufs : EAIO_COPY_NBUFS;
+
+	if (!len) {
+		return 0;
+	}
+	/*no point in buffers that would never be filled*/
+	if ((uint64_t)nbufs > (len + cp.bs - 1) / cp.bs) {
+		nbufs = (len + cp.bs - 1) / cp.bs;
+	}
+
+	struct eaio_copy_buf *bufs = calloc(nbufs, sizeof(*bufs));
+	if (!bufs) {
+		return -ENOMEM;
+	}
+	for (int i = 0; i < nbufs; i++) {
+		bufs[i].cp = &cp;
+		if (pool) {
+			bufs[i].data = eaio_bufpool_alloc(pool, cp.bs);
+		} else if (posix_memalign((void **)&bufs[i].data, getpagesize(), cp.bs)) {
+			bufs[i].data = NULL;
+		}
+		if (!bufs[i].data) {
+			nbufs = i;
+			break;
+		}
+	}
+
+	ssize_t ret = -ENOMEM;
+	if (nbufs) {
+		pthread_mutex_init(&cp.lock, NULL);
+		ewait_init(&cp.wait);
+		cp.active = nbufs;
+		for (int i = 0; i < nbufs; i++) {
+			eaio_copy_read(&bufs[i]);
+		}
+		ewait_sleep(&cp.wait);
+		pthread_mutex_destroy(&cp.lock);
+		ret = cp.error ? cp.error : (ssize_t)cp.copied;
+	}
+
+	for (int i = 0; i < nbufs; i++) {
+		if (pool) {
+			eaio_bufpool_free(pool, bufs[i].data);
+		} else {
+			free(bufs[i].data);
+		}
+	}
+	free(bufs);
+	return ret;
+}
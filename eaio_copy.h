@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "eaio_api.h"
+#include "eaio_bufpool.h"
+
+struct eaio_copy_attr {
+	size_t bs;	/*bytes per request, default 1MB*/
+	int nbufs;	/*buffers circulating, each one read then written, default 4*/
+	int prio;	/*class of every request on both queues*/
+	struct eaio_bufpool *pool;	/*buffers come from here, NULL for posix_memalign*/
+};
+
+/*
+ * Copy len bytes from rfd at roff to wfd at woff: reads go to queue rq and each
+ * filled buffer is written through queue wq while the other buffers are being
+ * read, so reads and writes overlap. Blocks the caller until the last write.
+ * Return the bytes copied, less than len if rfd ended first, or -errno.
+ */
+ssize_t eaio_copy_range(struct eaio_context *aio_ctx,
+		int rq, int rfd, off_t roff,
+		int wq, int wfd, off_t woff,
+		uint64_t len, const struct eaio_copy_attr *attr);
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "mpsc.h"
+#include "etask.h"
+#include "eaio_logger.h"
+#include "eaio_coro.h"
+
+#define EAIO_CORO_STACK         (64UL << 10)
+#define EAIO_CORO_STACK_CACHE   256	/*stacks a worker keeps for the next coroutines*/
+
+struct eaio_coro_worker;
+
+struct eaio_coro {
+	struct mpsc_node node;	/*on the ready queue of its worker*/
+	struct eaio_coro_worker *worker;
+	void (*fn)(void *arg);
+	void *arg;
+	bool finished;
+
+	char *stack;	/*attached by the worker on the first run*/
+	ucontext_t ctx;
+};
+
+struct eaio_coro_worker {
+	pthread_t tid;
+	struct eaio_coro_sched *sched;
+	struct mpsc_queue ready;	/*pushed by anyone, popped by the worker*/
+	int efd;	/*wakes the worker when idle is set*/
+	int idle;	/*atomic*/
+	ucontext_t main;	/*the worker loop, coroutines switch back to it*/
+
+	/*free stacks, chained through their first word; touched by the worker only*/
+	void *stacks;
+	int nstacks;
+} __attribute__((aligned(64)));
+
+struct eaio_coro_sched {
+	size_t stack_size;
+	int next;	/*atomic, round robin of spawn*/
+	int alive;	/*atomic*/
+	bool stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/*alive dropped to 0*/
+
+	int nworkers;
+	struct eaio_coro_worker worker[0];
+};
+
+static __thread struct eaio_coro *tls_coro = NULL;
+
+static void *eaio_coro_stack_get(struct eaio_coro_worker *worker)
+{
+	size_t size = worker->sched->stack_size;
+	size_t guard = getpagesize();
+
+	if (worker->stacks) {
+		void *stack = worker->stacks;
+		worker->stacks = *(void **)stack;
+		worker->nstacks--;
+		return stack;
+	}
+
+	char *base = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		eaio_printf(LOG_ERR, "coroutine stack of %zu bytes: %m", size);
+		return NULL;
+	}
+	/*an overflow faults instead of eating the next stack*/
+	mprotect(base, guard, PROT_NONE);
+	return base + guard;
+}
+
+static void eaio_coro_stack_put(struct eaio_coro_worker *worker, void *stack)
+{
+	size_t guard = getpagesize();
+
+	if (worker->nstacks < EAIO_CORO_STACK_CACHE) {
+		*(void **)stack = worker->stacks;
+		worker->stacks = stack;
+		worker->nstacks++;
+		return;
+	}
+	munmap((char *)stack - guard, guard + worker->sched->stack_size);
+}
+
+static void eaio_coro_ready(struct eaio_coro *coro)
+{
+	struct eaio_coro_worker *worker = coro->worker;
+
+	mpsc_push(&worker->ready, &coro->node);
+	/*pairs with the fence of the worker going idle, one of us sees the other*/
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST)) {
+		eventfd_xsend(worker->efd, 1);
+	}
+}
+
+static void eaio_coro_entry(void)
+{
+	struct eaio_coro *coro = tls_coro;
+
+	coro->fn(coro->arg);
+	coro->finished = true;
+	setcontext(&coro->worker->main);
+}
+
+static void eaio_coro_run(struct eaio_coro_worker *worker, struct eaio_coro *coro)
+{
+	struct eaio_coro_sched *sched = worker->sched;
+
+	if (!coro->stack) {
+		coro->stack = eaio_coro_stack_get(worker);
+		if (!coro->stack) {
+			/*never started, counted as done so that wait does not hang*/
+			coro->finished = true;
+			goto out;
+		}
+		getcontext(&coro->ctx);
+		coro->ctx.uc_stack.ss_sp = coro->stack;
+		coro->ctx.uc_stack.ss_size = sched->stack_size;
+		coro->ctx.uc_link = NULL;
+		makecontext(&coro->ctx, eaio_coro_entry, 0);
+	}
+
+	tls_coro = coro;
+	swapcontext(&worker->main, &coro->ctx);
+	tls_coro = NULL;
+out:
+	if (!coro->finished) {
+		return;
+	}
+	if (coro->stack) {
+		eaio_coro_stack_put(worker, coro->stack);
+	}
+	free(coro);
+	if (__atomic_sub_fetch(&sched->alive, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&sched->lock);
+		pthread_cond_broadcast(&sched->cond);
+		pthread_mutex_unlock(&sched->lock);
+	}
+}
+
+static void *eaio_coro_worker_loop(void *arg)
+{
+	struct eaio_coro_worker *worker = arg;
+	struct eaio_coro_sched *sched = worker->sched;
+
+	for (;;) {
+		struct mpsc_node *node = mpsc_pop(&worker->ready);
+		if (node) {
+			eaio_coro_run(worker, mpsc_entry(node, struct eaio_coro, node));
+			continue;
+		}
+		/*a push half done, it shows up in a moment*/
+		if (!mpsc_empty(&worker->ready)) {
+			continue;
+		}
+		if (__atomic_load_n(&sched->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		__atomic_store_n(&worker->idle, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!mpsc_empty(&worker->ready) || __atomic_load_n(&sched->stop, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&worker->idle, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		eventfd_t cnt;
+		eventfd_xrecv(worker->efd, &cnt);
+	}
+	return NULL;
+}
+
+static void eaio_coro_worker_free(struct eaio_coro_worker *worker)
+{
+	size_t guard = getpagesize();
+
+	while (worker->stacks) {
+		void *stack = worker->stacks;
+		worker->stacks = *(void **)stack;
+		munmap((char *)stack - guard, guard + worker->sched->stack_size);
+	}
+	close(worker->efd);
+}
+
+static void eaio_coro_sched_stop(struct eaio_coro_sched *sched, int nworkers)
+{
+	__atomic_store_n(&sched->stop, true, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < nworkers; i++) {
+		struct eaio_coro_worker *worker = &sched->worker[i];
+
+		if (__atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST)) {
+			eventfd_xsend(worker->efd, 1);
+		}
+		pthread_join(worker->tid, NULL);
+		eaio_coro_worker_free(worker);
+	}
+}
+
+struct eaio_coro_sched *eaio_coro_sched_create(const struct eaio_coro_attr *attr)
+{
+	int nworkers = (attr && (attr->nthreads > 0)) ? attr->nthreads : 1;
+	size_t page = getpagesize();
+	size_t stack_size = (attr && attr->stack_size) ? attr->stack_size : EAIO_CORO_STACK;
+
+	struct eaio_coro_sched *sched = calloc(1, sizeof(*sched) + nworkers * sizeof(struct eaio_coro_worker));
+	if (!sched) {
+		return NULL;
+	}
+	sched->stack_size = (stack_size + page - 1) & ~(page - 1);
+	sched->nworkers = nworkers;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->cond, NULL);
+
+	int idx = 0;
+	for (; idx < nworkers; idx++) {
+		struct eaio_coro_worker *worker = &sched->worker[idx];
+
+		worker->sched = sched;
+		INIT_MPSC_QUEUE(&worker->ready);
+		worker->efd = eventfd(0, EFD_CLOEXEC);
+		if (worker->efd < 0) {
+			goto fail;
+		}
+
+		pthread_attr_t pattr;
+		pthread_attr_init(&pattr);
+		if (attr && attr->cpus && (attr->cpus[idx] >= 0)) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(attr->cpus[idx], &set);
+			pthread_attr_setaffinity_np(&pattr, sizeof(set), &set);
+		}
+		int ret = pthread_create(&worker->tid, &pattr, eaio_coro_worker_loop, worker);
+		pthread_attr_destroy(&pattr);
+		if (ret != 0) {
+			close(worker->efd);
+			goto fail;
+		}
+	}
+	return sched;
+fail:
+	eaio_coro_sched_stop(sched, idx);
+	pthread_cond_destroy(&sched->cond);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched);
+	return NULL;
+}
+
+void eaio_coro_sched_destroy(struct eaio_coro_sched *sched)
+{
+	assert(__atomic_load_n(&sched->alive, __ATOMIC_ACQUIRE) == 0);
+	eaio_coro_sched_stop(sched, sched->nworkers);
+	pthread_cond_destroy(&sched->cond);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched);
+}
+
+int eaio_coro_spawn(struct eaio_coro_sched *sched, void (*fn)(void *arg), void *arg)
+{
+	struct eaio_coro *coro = calloc(1, sizeof(*coro));
+	if (!coro) {
+		return -1;
+	}
+	int idx = __atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED) % sched->nworkers;
+	coro->worker = &sched->worker[idx];
+	coro->fn = fn;
+	coro->arg = arg;
+
+	__atomic_add_fetch(&sched->alive, 1, __ATOMIC_ACQ_REL);
+	eaio_coro_ready(coro);
+	return 0;
+}
+
+void eaio_coro_sched_wait(struct eaio_coro_sched *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	while (__atomic_load_n(&sched->alive, __ATOMIC_ACQUIRE) > 0) {
+		pthread_cond_wait(&sched->cond, &sched->lock);
+	}
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/*back to the worker loop until someone puts coro on the ready queue again*/
+static void eaio_coro_park(struct eaio_coro *coro)
+{
+	swapcontext(&coro->ctx, &coro->worker->main);
+}
+
+void eaio_coro_yield(void)
+{
+	struct eaio_coro *coro = tls_coro;
+
+	if (!coro) {
+		return;
+	}
+	/*only this worker pops it, and not before the switch below*/
+	eaio_coro_ready(coro);
+	eaio_coro_park(coro);
+}
+
+struct eaio_coro_io {
+	struct eaio_coro *coro;
+	int result;
+};
+
+static void eaio_coro_io_done(int result, void *usr)
+{
+	struct eaio_coro_io *io = usr;
+
+	io->result = result;
+	eaio_coro_ready(io->coro);
+}
+
+int eaio_coro_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset)
+{
+	struct eaio_coro *coro = tls_coro;
+
+	if (!coro) {
+		return eaio_context_rdwt(aio_ctx, opt, qnum, prio, fd, buf, count, offset, NULL, NULL);
+	}
+
+	/*
+	 * On the parked stack, alive until the coroutine runs again. The submit goes
+	 * down the filters too, a hit wakes it before the park below.
+	 */
+	struct eaio_coro_io io = {
+		.coro = coro,
+		.result = 0,
+	};
+	if (eaio_context_submit(aio_ctx, opt, qnum, prio, fd, buf, count, offset,
+			eaio_coro_io_done, &io) < 0) {
+		return -1;
+	}
+	eaio_coro_park(coro);
+
+	if (io.result < 0) {
+		errno = -io.result;
+		return -1;
+	}
+	return io.result;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "eaio_api.h"
+
+struct eaio_coro_attr {
+	int nthreads;	/*worker threads running the coroutines, default 1*/
+	size_t stack_size;	/*per coroutine, default 64KB, a guard page is added below it*/
+	const int *cpus;	/*pin worker j to cpus[j] when given and not negative*/
+};
+
+struct eaio_coro_sched;
+
+/*
+ * Stackful coroutines on a few threads, each one stays on the worker it was
+ * given at spawn. A coroutine gives its thread up only in eaio_coro_rdwt() or
+ * eaio_coro_yield(), anything else blocking holds every coroutine of the worker.
+ */
+struct eaio_coro_sched *eaio_coro_sched_create(const struct eaio_coro_attr *attr);
+
+/*call eaio_coro_sched_wait() first, every coroutine must have returned*/
+void eaio_coro_sched_destroy(struct eaio_coro_sched *sched);
+
+/*start fn(arg) as a coroutine, from any thread or coroutine; 0 or -1*/
+int eaio_coro_spawn(struct eaio_coro_sched *sched, void (*fn)(void *arg), void *arg);
+
+/*block the calling thread, not a coroutine, until every coroutine has returned*/
+void eaio_coro_sched_wait(struct eaio_coro_sched *sched);
+
+/*let the other ready coroutines of the worker run, a no-op outside a coroutine*/
+void eaio_coro_yield(void);
+
+/*
+ * eaio_context_rdwt() that parks the calling coroutine instead of its thread
+ * until the request is done. It takes the way of eaio_context_submit() through
+ * the filters, none of which blocks the worker. Outside a coroutine it is
+ * eaio_context_rdwt(). Return the byte count, or -1 with errno set.
+ */
+int eaio_coro_rdwt(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset);
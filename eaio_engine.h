@@ -0,0 +1,42 @@
+#pragma once
+
+#include <time.h>
+
+#include "eaio_api.h"
+
+static inline uint64_t eaio_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Backend of an eaio_queue.
+ * Requests are always described by a struct iocb and completions are reported
+ * as struct io_event, whatever the kernel interface underneath.
+ */
+struct eaio_engine_ops {
+	const char *name;
+
+	/*completions must be signalled on qaio->o_efd*/
+	int (*setup)(struct eaio_queue *qaio, int depth);
+	void (*destroy)(struct eaio_queue *qaio);
+
+	/*same contract as io_submit(): count of accepted iocbs or -errno*/
+	int (*submit)(struct eaio_queue *qaio, struct iocb *iocbp[], int nr);
+
+	/*reap at most nr events without blocking*/
+	int (*getevents)(struct eaio_queue *qaio, struct io_event *events, int nr);
+
+	/*
+	 * Ask the kernel to drop a submitted iocb: 1 if it did and filled ev, which
+	 * getevents will then never report, 0 if the completion still comes through
+	 * getevents, or -errno when the request cannot be cancelled.
+	 */
+	int (*cancel)(struct eaio_queue *qaio, struct iocb *iocb, struct io_event *ev);
+};
+
+extern const struct eaio_engine_ops eaio_engine_libaio;
+extern const struct eaio_engine_ops eaio_engine_uring;
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "eaio_api.h"
+
+/*an eaio_context_rdwt[_timed]() or eaio_context_submit[_timed]() call as seen by the filters*/
+struct eaio_filter_req {
+	enum eaio_opt opt;
+	int qnum;
+	int prio;
+	int fd;
+	void *buf;
+	size_t count;
+	off_t offset;
+	int timeout;	/*msec as in eaio_context_rdwt_timed(), 0 for none*/
+
+	eaio_watch_fcb_t fcb;
+	void *usr;	/*of fcb, or of done*/
+
+	/*set for the async calls, called once with the byte count or -errno*/
+	eaio_done_fcb_t done;
+	eaio_tag_t *tag;	/*filled in if and when the request reaches the queues*/
+};
+
+struct eaio_filter;
+
+struct eaio_filter_ops {
+	const char *name;
+
+	/*same contract as eaio_context_rdwt(), what is not served goes to eaio_filter_next()*/
+	int (*rdwt)(struct eaio_filter *flt, const struct eaio_filter_req *req);
+
+	/*
+	 * Same contract as eaio_context_submit(): serve req and call req->done(), maybe
+	 * before returning, or pass it on with eaio_filter_submit_next(). It must not
+	 * block, it runs from done() on the executor threads too: what it holds back
+	 * is written out with async requests and req waits for them. NULL for a layer
+	 * that holds nothing back, it only gets the range of a write dropped.
+	 */
+	int (*submit)(struct eaio_filter *flt, const struct eaio_filter_req *req);
+
+	/*forget what is held of fd in [offset, offset + len), len 0 for all of it*/
+	void (*invalidate)(struct eaio_filter *flt, int fd, off_t offset, size_t len);
+
+	/*
+	 * Write out what is held back of fd in [offset, offset + len), len 0 for all
+	 * of it, or of every fd when fd is negative; 0 or -errno.
+	 */
+	int (*flush)(struct eaio_filter *flt, int fd, off_t offset, size_t len);
+};
+
+/*
+ * A layer in front of the queues of a context, embedded in the state of the
+ * module implementing it. Blocking calls go down the chain through rdwt, the
+ * async ones and the requests of eaio_context_rdwt_batch() through submit.
+ */
+struct eaio_filter {
+	const struct eaio_filter_ops *ops;
+	struct eaio_context *aio_ctx;
+	struct eaio_filter *next;	/*the layer below, NULL for the queues*/
+};
+
+/*
+ * Put flt on top of the chain, so it sees the requests first.
+ * Not thread safe: push and remove while no eaio_context_rdwt() is running.
+ */
+void eaio_context_push_filter(struct eaio_context *aio_ctx, struct eaio_filter *flt,
+		const struct eaio_filter_ops *ops);
+
+void eaio_context_remove_filter(struct eaio_context *aio_ctx, struct eaio_filter *flt);
+
+/*hand req to the layer below flt*/
+int eaio_filter_next(struct eaio_filter *flt, const struct eaio_filter_req *req);
+
+/*hand the async req to the layer below flt*/
+int eaio_filter_submit_next(struct eaio_filter *flt, const struct eaio_filter_req *req);
+
+/*
+ * eaio_context_submit() for the layer's own requests, e.g. prefetches: straight
+ * to the queues, the chain is not consulted.
+ */
+int eaio_filter_submit(struct eaio_filter *flt, enum eaio_opt opt, int qnum, int prio,
+		int fd, void *buf, size_t count, off_t offset,
+		eaio_done_fcb_t done, void *usr);
+
+/*
+ * Hand a write down with what flt holds of its range dropped before, so nobody
+ * is served the old data meanwhile, and again after, for fills it raced with.
+ */
+int eaio_filter_write_around(struct eaio_filter *flt, const struct eaio_filter_req *req);
+
+/*a PWRITE or PWRITEV, barrier or not*/
+static inline bool eaio_filter_is_write(const struct eaio_filter_req *req)
+{
+	int opt = req->opt & ~EAIO_OPT_BARRIER;
+	return (opt == EAIO_OPT_PWRITE) || (opt == EAIO_OPT_PWRITEV);
+}
+
+/*bytes from offset the request covers, the segments added up for the vectored ops*/
+static inline size_t eaio_filter_req_len(const struct eaio_filter_req *req)
+{
+	int opt = req->opt & ~EAIO_OPT_BARRIER;
+	if ((opt != EAIO_OPT_PREADV) && (opt != EAIO_OPT_PWRITEV)) {
+		return req->count;
+	}
+
+	const struct iovec *iov = req->buf;
+	size_t len = 0;
+	for (size_t i = 0; i < req->count; i++) {
+		len += iov[i].iov_len;
+	}
+	return len;
+}
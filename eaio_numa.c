@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "eaio_logger.h"
+#include "eaio_numa.h"
+
+/*from linux/mempolicy.h, numaif.h comes with libnuma*/
+#define EAIO_MPOL_PREFERRED 1
+
+#define EAIO_NUMA_SYSFS "/sys/devices/system/node"
+
+/*first line of a sysfs file, without the newline*/
+static int eaio_numa_read(const char *path, char *buf, size_t len)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return -1;
+	}
+	char *line = fgets(buf, len, fp);
+	fclose(fp);
+	if (!line) {
+		return -1;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/*"0-3,8,10-11" into set, the highest number or -1*/
+static int eaio_numa_parse_list(const char *list, cpu_set_t *set)
+{
+	int high = -1;
+
+	if (set) {
+		CPU_ZERO(set);
+	}
+	for (const char *p = list; *p;) {
+		char *end;
+		long lo = strtol(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		long hi = lo;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long i = lo; i <= hi; i++) {
+			if (set && (i < CPU_SETSIZE)) {
+				CPU_SET(i, set);
+			}
+		}
+		if (hi > high) {
+			high = hi;
+		}
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return high;
+}
+
+int eaio_numa_nodes(void)
+{
+	char buf[256];
+
+	if (eaio_numa_read(EAIO_NUMA_SYSFS "/possible", buf, sizeof(buf)) < 0) {
+		return 1;
+	}
+	int high = eaio_numa_parse_list(buf, NULL);
+	return (high >= 0) ? high + 1 : 1;
+}
+
+int eaio_numa_cpus(int node, cpu_set_t *set)
+{
+	char path[128];
+	char buf[4096];
+
+	if (node < 0) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), EAIO_NUMA_SYSFS "/node%d/cpulist", node);
+	if (eaio_numa_read(path, buf, sizeof(buf)) < 0) {
+		return -1;
+	}
+	return (eaio_numa_parse_list(buf, set) >= 0) ? 0 : -1;
+}
+
+int eaio_numa_node_of_cpu(int cpu)
+{
+	int nodes = eaio_numa_nodes();
+	cpu_set_t set;
+
+	if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+		return -1;
+	}
+	for (int node = 0; node < nodes; node++) {
+		if ((eaio_numa_cpus(node, &set) == 0) && CPU_ISSET(cpu, &set)) {
+			return node;
+		}
+	}
+	return -1;
+}
+
+int eaio_numa_node(void)
+{
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+		return -1;
+	}
+	return node;
+}
+
+int eaio_numa_dev_node(dev_t dev)
+{
+	char path[PATH_MAX + 16];
+	char real[PATH_MAX];
+	char buf[32];
+
+	/*a partition has no device link, its disk does*/
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device", major(dev), minor(dev));
+	if (!realpath(path, real)) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../device", major(dev), minor(dev));
+		if (!realpath(path, real)) {
+			return -1;
+		}
+	}
+
+	/*up to the first ancestor that knows: the PCIe function behind a namespace, a virtio or SCSI disk*/
+	size_t top = strlen("/sys/devices");
+	for (;;) {
+		snprintf(path, sizeof(path), "%s/numa_node", real);
+		if (eaio_numa_read(path, buf, sizeof(buf)) == 0) {
+			/*-1 when the platform has no affinity for it*/
+			return atoi(buf);
+		}
+		char *slash = strrchr(real, '/');
+		if (!slash || ((size_t)(slash - real) <= top)) {
+			return -1;
+		}
+		*slash = '\0';
+	}
+}
+
+int eaio_numa_fd_node(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		return -1;
+	}
+	return eaio_numa_dev_node(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+}
+
+static int eaio_numa_mask(int node, unsigned long *mask, size_t words)
+{
+	if ((node < 0) || (node >= EAIO_NUMA_NODES_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(mask, 0, words * sizeof(unsigned long));
+	mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	return 0;
+}
+
+int eaio_numa_bind(void *addr, size_t len, int node)
+{
+	struct eaio_numa_policy pol;
+
+	if (eaio_numa_mask(node, pol.mask, sizeof(pol.mask) / sizeof(pol.mask[0])) < 0) {
+		return -1;
+	}
+	/*the kernel reads maxnode - 1 bits*/
+	if (syscall(SYS_mbind, addr, len, EAIO_MPOL_PREFERRED, pol.mask, EAIO_NUMA_NODES_MAX + 1, 0) < 0) {
+		eaio_printf(LOG_DEBUG, "mbind to node %d: %m", node);
+		return -1;
+	}
+	return 0;
+}
+
+void eaio_numa_enter(int node, struct eaio_numa_policy *old)
+{
+	struct eaio_numa_policy pol;
+
+	old->mode = -1;
+	if (node < 0) {
+		return;
+	}
+	if (syscall(SYS_get_mempolicy, &old->mode, old->mask, EAIO_NUMA_NODES_MAX, NULL, 0) < 0) {
+		eaio_printf(LOG_DEBUG, "get_mempolicy: %m");
+		old->mode = -1;
+		return;
+	}
+	if ((eaio_numa_mask(node, pol.mask, sizeof(pol.mask) / sizeof(pol.mask[0])) < 0) ||
+		(syscall(SYS_set_mempolicy, EAIO_MPOL_PREFERRED, pol.mask, EAIO_NUMA_NODES_MAX + 1) < 0)) {
+		eaio_printf(LOG_DEBUG, "set_mempolicy to node %d: %m", node);
+		old->mode = -1;
+	}
+}
+
+void eaio_numa_leave(const struct eaio_numa_policy *old)
+{
+	if (old->mode < 0) {
+		return;
+	}
+	syscall(SYS_set_mempolicy, old->mode, old->mask, EAIO_NUMA_NODES_MAX + 1);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sched.h>	/*cpu_set_t, define _GNU_SOURCE before it*/
+#include <stddef.h>
+#include <sys/types.h>
+
+#define EAIO_NUMA_NODES_MAX 1024	/*bits of the node masks handed to the kernel*/
+
+/*
+ * Thin helpers over sysfs and the mempolicy syscalls, no libnuma needed.
+ * Without NUMA everything reports node 0 or -1 and binding is a no-op.
+ */
+
+/*nodes the system may have online, 1 when it is not NUMA*/
+int eaio_numa_nodes(void);
+
+/*cpus of node, 0 or -1 if it has none or is unknown*/
+int eaio_numa_cpus(int node, cpu_set_t *set);
+
+/*node of cpu, -1 if unknown*/
+int eaio_numa_node_of_cpu(int cpu);
+
+/*node of the cpu the calling thread runs on right now, -1 if unknown*/
+int eaio_numa_node(void);
+
+/*
+ * Node the block device dev is attached to, e.g. the socket of its PCIe slot;
+ * -1 when the kernel does not tell, as for virtual devices.
+ */
+int eaio_numa_dev_node(dev_t dev);
+
+/*eaio_numa_dev_node() of fd's block device, or of the one its file lives on*/
+int eaio_numa_fd_node(int fd);
+
+/*
+ * Prefer node for the pages of [addr, addr + len) not faulted in yet, addr
+ * page aligned; they fall back to other nodes when it is full. 0 or -1.
+ */
+int eaio_numa_bind(void *addr, size_t len, int node);
+
+struct eaio_numa_policy {
+	int mode;
+	unsigned long mask[EAIO_NUMA_NODES_MAX / (8 * sizeof(unsigned long))];
+};
+
+/*
+ * Make the calling thread prefer node for what it allocates, kernel memory
+ * included, until eaio_numa_leave() restores old. A no-op for a negative node.
+ */
+void eaio_numa_enter(int node, struct eaio_numa_policy *old);
+
+void eaio_numa_leave(const struct eaio_numa_policy *old);
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "eaio_filter.h"
+#include "eaio_readahead.h"
+
+#define EAIO_RA_WINDOW  (256UL << 10)
+#define EAIO_RA_DEPTH   4
+#define EAIO_RA_STREAMS 64
+#define EAIO_RA_TRIGGER 2
+#define EAIO_RA_ALIGN   4096
+
+#define EAIO_RA_AGAIN   (-2)	/*eaio_ra_serve(): a buffer is still loading*/
+
+enum eaio_ra_state {
+	EAIO_RA_EMPTY = 0,
+	EAIO_RA_LOADING = 1,
+	EAIO_RA_READY = 2
+};
+
+enum eaio_ra_mode {
+	EAIO_RA_NONE = 0,
+	EAIO_RA_SEQ = 1,	/*each read starts where the last one ended*/
+	EAIO_RA_STRIDE = 2	/*same size each time, a fixed distance apart*/
+};
+
+struct eaio_ra_stream;
+
+/*an async read waiting for a buffer still loading*/
+struct eaio_ra_wait {
+	struct eaio_ra_wait *next;
+	struct eaio_filter_req req;
+	ssize_t got;
+};
+
+struct eaio_ra_buf {
+	struct eaio_ra_stream *st;
+	char *data;	/*window bytes, allocated on first use*/
+	off_t off;
+	size_t len;
+	enum eaio_ra_state state;
+	int result;	/*bytes read or -errno once READY*/
+	bool stale;	/*dropped while LOADING, back to EMPTY when it completes*/
+	bool used;	/*served a read*/
+};
+
+/*
+ * The pattern of one fd. last_* is the previous read, cand the pattern it and
+ * the ones before keep, hits how many times in a row; mode is cand once hits
+ * reach the trigger.
+ */
+struct eaio_ra_stream {
+	struct eaio_ra *ra;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/*a buffer left LOADING*/
+	int fd;	/*-1 when free*/
+	int qnum;
+
+	off_t last_off;
+	size_t last_len;
+	enum eaio_ra_mode cand;
+	off_t stride;
+	int hits;
+
+	enum eaio_ra_mode mode;
+	off_t next;	/*where the next prefetch starts*/
+	bool eof;	/*a prefetch came back short, stop until the pattern restarts*/
+	int loading;
+	struct eaio_ra_buf *buf;
+	struct eaio_ra_wait *waits;	/*each one needs a LOADING buffer*/
+};
+
+struct eaio_ra {
+	struct eaio_filter filter;
+	size_t window;
+	int depth;
+	int trigger;
+	int prio;
+	size_t align;
+	struct eaio_bufpool *pool;
+
+	struct eaio_ra_stats stats;	/*atomic*/
+	int nstreams;
+	struct eaio_ra_stream streams[0];
+};
+
+static inline off_t rounddown_to(off_t x, size_t align)
+{
+	return x - (x % align);
+}
+
+static inline off_t roundup_to(off_t x, size_t align)
+{
+	return rounddown_to(x + align - 1, align);
+}
+
+/*a LOADING buffer is only marked, the read still targets its memory*/
+static void eaio_ra_release(struct eaio_ra_stream *st, struct eaio_ra_buf *buf)
+{
+	if ((buf->state == EAIO_RA_EMPTY) || buf->stale) {
+		return;
+	}
+	if (buf->state == EAIO_RA_LOADING) {
+		buf->stale = true;
+		return;
+	}
+	if (!buf->used && (buf->result > 0)) {
+		__atomic_add_fetch(&st->ra->stats.wasted, buf->result, __ATOMIC_RELAXED);
+	}
+	buf->state = EAIO_RA_EMPTY;
+}
+
+/*drop the buffers overlapping [off, off + len), all of them when len is 0*/
+static void eaio_ra_drop(struct eaio_ra_stream *st, off_t off, size_t len)
+{
+	for (int i = 0; i < st->ra->depth; i++) {
+		struct eaio_ra_buf *buf = &st->buf[i];
+
+		if (len && ((buf->off + (off_t)buf->len <= off) || (buf->off >= off + (off_t)len))) {
+			continue;
+		}
+		eaio_ra_release(st, buf);
+	}
+}
+
+/*the buffers ending before end will not be read again*/
+static void eaio_ra_consume(struct eaio_ra_stream *st, off_t end)
+{
+	for (int i = 0; i < st->ra->depth; i++) {
+		struct eaio_ra_buf *buf = &st->buf[i];
+
+		if (buf->off + (off_t)buf->len <= end) {
+			eaio_ra_release(st, buf);
+		}
+	}
+}
+
+static ssize_t eaio_ra_serve(struct eaio_ra_stream *st, char *out, off_t offset, size_t count, bool wait);
+static void eaio_ra_refill(struct eaio_ra_stream *st);
+
+/*the waiting reads the buffers can settle now, called locked*/
+static struct eaio_ra_wait *eaio_ra_settle(struct eaio_ra_stream *st)
+{
+	struct eaio_ra_wait *settled = NULL;
+
+	for (struct eaio_ra_wait **pp = &st->waits; *pp;) {
+		struct eaio_ra_wait *w = *pp;
+		const struct eaio_filter_req *req = &w->req;
+
+		/*the slot may have gone to another fd meanwhile*/
+		w->got = (req->fd == st->fd) ? eaio_ra_serve(st, req->buf, req->offset, req->count, false) : -1;
+		if (w->got == EAIO_RA_AGAIN) {
+			pp = &w->next;
+			continue;
+		}
+		if (w->got >= 0) {
+			eaio_ra_consume(st, req->offset + req->count);
+		}
+		*pp = w->next;
+		w->next = settled;
+		settled = w;
+	}
+	return settled;
+}
+
+/*finish what eaio_ra_settle() took, unlocked*/
+static void eaio_ra_finish(struct eaio_ra *ra, struct eaio_ra_wait *settled)
+{
+	while (settled) {
+		struct eaio_ra_wait *w = settled;
+		settled = w->next;
+
+		if (w->got >= 0) {
+			__atomic_add_fetch(&ra->stats.hits, 1, __ATOMIC_RELAXED);
+			w->req.done(w->got, w->req.usr);
+		} else {
+			__atomic_add_fetch(&ra->stats.misses, 1, __ATOMIC_RELAXED);
+			if (eaio_filter_submit_next(&ra->filter, &w->req) < 0) {
+				w->req.done(-errno, w->req.usr);
+			}
+		}
+		free(w);
+	}
+}
+
+static void eaio_ra_done(int result, void *usr)
+{
+	struct eaio_ra_buf *buf = usr;
+	struct eaio_ra_stream *st = buf->st;
+	struct eaio_ra_wait *settled = NULL;
+
+	pthread_mutex_lock(&st->lock);
+	st->loading--;
+	if (result > 0) {
+		__atomic_add_fetch(&st->ra->stats.prefetched, result, __ATOMIC_RELAXED);
+	}
+	if (buf->stale) {
+		if (result > 0) {
+			__atomic_add_fetch(&st->ra->stats.wasted, result, __ATOMIC_RELAXED);
+		}
+		buf->stale = false;
+		buf->state = EAIO_RA_EMPTY;
+	} else {
+		buf->result = result;
+		buf->state = EAIO_RA_READY;
+		if ((result >= 0) && ((size_t)result < buf->len)) {
+			st->eof = true;
+		}
+	}
+	if (st->waits) {
+		settled = eaio_ra_settle(st);
+		eaio_ra_refill(st);
+	}
+	struct eaio_ra *ra = st->ra;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+
+	eaio_ra_finish(ra, settled);
+}
+
+/*keep every free buffer of the stream reading ahead*/
+static void eaio_ra_refill(struct eaio_ra_stream *st)
+{
+	struct eaio_ra *ra = st->ra;
+
+	for (int i = 0; (i < ra->depth) && (st->mode != EAIO_RA_NONE) && !st->eof; i++) {
+		struct eaio_ra_buf *buf = &st->buf[i];
+		if (buf->state != EAIO_RA_EMPTY) {
+			continue;
+		}
+
+		off_t off = st->next;
+		size_t len = ra->window;
+		if (st->mode == EAIO_RA_STRIDE) {
+			off = rounddown_to(st->next, ra->align);
+			len = roundup_to(st->next + st->last_len, ra->align) - off;
+			if (len > ra->window) {
+				/*records larger than a buffer are left alone*/
+				return;
+			}
+		}
+		if (!buf->data) {
+			if (ra->pool) {
+				buf->data = eaio_bufpool_alloc(ra->pool, ra->window);
+			} else if (posix_memalign((void **)&buf->data, getpagesize(), ra->window)) {
+				buf->data = NULL;
+			}
+			if (!buf->data) {
+				return;
+			}
+		}
+
+		buf->off = off;
+		buf->len = len;
+		buf->state = EAIO_RA_LOADING;
+		buf->stale = false;
+		buf->used = false;
+		st->loading++;
+		if (eaio_filter_submit(&ra->filter, EAIO_OPT_PREAD, st->qnum, ra->prio,
+				st->fd, buf->data, len, off, eaio_ra_done, buf) < 0) {
+			buf->state = EAIO_RA_EMPTY;
+			st->loading--;
+			return;
+		}
+		st->next += (st->mode == EAIO_RA_STRIDE) ? st->stride : (off_t)len;
+	}
+}
+
+/*follow the pattern with one more read, restarting the prefetch when it changes*/
+static void eaio_ra_observe(struct eaio_ra_stream *st, off_t off, size_t count)
+{
+	struct eaio_ra *ra = st->ra;
+	enum eaio_ra_mode seen = EAIO_RA_NONE;
+	off_t dist = off - st->last_off;
+
+	if (st->last_len) {
+		if (off == st->last_off + (off_t)st->last_len) {
+			seen = EAIO_RA_SEQ;
+		} else if ((dist > (off_t)st->last_len) && (count == st->last_len)) {
+			seen = EAIO_RA_STRIDE;
+		}
+	}
+	if ((seen != EAIO_RA_NONE) && (seen == st->cand) && ((seen == EAIO_RA_SEQ) || (dist == st->stride))) {
+		st->hits++;
+	} else {
+		st->cand = seen;
+		st->stride = dist;
+		st->hits = (seen != EAIO_RA_NONE) ? 1 : 0;
+	}
+	st->last_off = off;
+	st->last_len = count;
+
+	enum eaio_ra_mode mode = (st->hits >= ra->trigger) ? st->cand : EAIO_RA_NONE;
+	if (mode != st->mode) {
+		eaio_ra_drop(st, 0, 0);
+		st->mode = mode;
+		st->eof = false;
+		st->next = 0;
+	}
+	/*start, or catch up with a reader that got ahead of the prefetch*/
+	if (mode == EAIO_RA_SEQ) {
+		off_t from = rounddown_to(off + count, ra->align);
+		if (st->next < from) {
+			st->next = from;
+		}
+	} else if ((mode == EAIO_RA_STRIDE) && (st->next <= off)) {
+		st->next = off + st->stride;
+	}
+}
+
+static struct eaio_ra_buf *eaio_ra_find(struct eaio_ra_stream *st, off_t at)
+{
+	for (int i = 0; i < st->ra->depth; i++) {
+		struct eaio_ra_buf *buf = &st->buf[i];
+
+		if ((buf->state != EAIO_RA_EMPTY) && !buf->stale &&
+			(buf->off <= at) && (at < buf->off + (off_t)buf->len)) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Copy [offset, offset + count) out of the buffers, waiting for the ones still
+ * loading or returning EAIO_RA_AGAIN without wait. Return -1 when some byte is
+ * not in a good buffer, including past the end of a short one: the file may
+ * have grown since, so ask the device.
+ */
+static ssize_t eaio_ra_serve(struct eaio_ra_stream *st, char *out, off_t offset, size_t count, bool wait)
+{
+	off_t end = offset + count;
+
+again:
+	for (off_t at = offset; at < end;) {
+		struct eaio_ra_buf *buf = eaio_ra_find(st, at);
+		if (!buf) {
+			return -1;
+		}
+		if (buf->state == EAIO_RA_LOADING) {
+			if (!wait) {
+				return EAIO_RA_AGAIN;
+			}
+			pthread_cond_wait(&st->cond, &st->lock);
+			goto again;
+		}
+		off_t valid = buf->off + ((buf->result > 0) ? buf->result : 0);
+		if ((buf->result < 0) || (valid < end && valid < buf->off + (off_t)buf->len)) {
+			/*try again later from wherever the device says the file ends*/
+			eaio_ra_release(st, buf);
+			st->eof = false;
+			return -1;
+		}
+		at = buf->off + buf->len;
+	}
+
+	for (off_t at = offset; at < end;) {
+		struct eaio_ra_buf *buf = eaio_ra_find(st, at);
+		off_t stop = buf->off + buf->len;
+		size_t n = ((stop < end) ? stop : end) - at;
+
+		memcpy(out + (at - offset), buf->data + (at - buf->off), n);
+		buf->used = true;
+		at += n;
+	}
+	return count;
+}
+
+/*the stream of fd, locked, taking its slot over from another fd if needed*/
+static struct eaio_ra_stream *eaio_ra_stream(struct eaio_ra *ra, int fd)
+{
+	struct eaio_ra_stream *st = &ra->streams[fd % ra->nstreams];
+
+	pthread_mutex_lock(&st->lock);
+	if (st->fd != fd) {
+		eaio_ra_drop(st, 0, 0);
+		st->fd = fd;
+		st->last_off = 0;
+		st->last_len = 0;
+		st->cand = EAIO_RA_NONE;
+		st->hits = 0;
+		st->mode = EAIO_RA_NONE;
+		st->eof = false;
+	}
+	return st;
+}
+
+static void eaio_ra_invalidate(struct eaio_filter *flt, int fd, off_t offset, size_t len)
+{
+	struct eaio_ra *ra = container_of(flt, struct eaio_ra, filter);
+	struct eaio_ra_stream *st = &ra->streams[fd % ra->nstreams];
+
+	pthread_mutex_lock(&st->lock);
+	if (st->fd == fd) {
+		eaio_ra_drop(st, offset, len);
+		st->eof = false;
+		if (!len) {
+			st->fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+static int eaio_ra_rdwt(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_ra *ra = container_of(flt, struct eaio_ra, filter);
+
+	if (eaio_filter_is_write(req)) {
+		return eaio_filter_write_around(flt, req);
+	}
+	if ((req->opt != EAIO_OPT_PREAD) || !req->count || (req->fd < 0)) {
+		return eaio_filter_next(flt, req);
+	}
+
+	struct eaio_ra_stream *st = eaio_ra_stream(ra, req->fd);
+	st->qnum = req->qnum;
+	eaio_ra_observe(st, req->offset, req->count);
+	ssize_t got = -1;
+	if (st->mode != EAIO_RA_NONE) {
+		got = eaio_ra_serve(st, req->buf, req->offset, req->count, true);
+	}
+	eaio_ra_consume(st, req->offset + req->count);
+	eaio_ra_refill(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if (got >= 0) {
+		__atomic_add_fetch(&ra->stats.hits, 1, __ATOMIC_RELAXED);
+		return got;
+	}
+	__atomic_add_fetch(&ra->stats.misses, 1, __ATOMIC_RELAXED);
+	return eaio_filter_next(flt, req);
+}
+
+static int eaio_ra_submit(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_ra *ra = container_of(flt, struct eaio_ra, filter);
+
+	if (eaio_filter_is_write(req)) {
+		/*dropped again once it is done, see eaio_filters_submit()*/
+		size_t len = eaio_filter_req_len(req);
+		eaio_ra_invalidate(flt, req->fd, req->offset, len ? len : 1);
+		return eaio_filter_submit_next(flt, req);
+	}
+	if ((req->opt != EAIO_OPT_PREAD) || !req->count || (req->fd < 0)) {
+		return eaio_filter_submit_next(flt, req);
+	}
+
+	struct eaio_ra_stream *st = eaio_ra_stream(ra, req->fd);
+	st->qnum = req->qnum;
+	eaio_ra_observe(st, req->offset, req->count);
+	ssize_t got = -1;
+	if (st->mode != EAIO_RA_NONE) {
+		got = eaio_ra_serve(st, req->buf, req->offset, req->count, false);
+	}
+	if (got == EAIO_RA_AGAIN) {
+		/*the buffers it needs stay until it is served*/
+		struct eaio_ra_wait *w = malloc(sizeof(*w));
+		if (w) {
+			w->req = *req;
+			w->next = st->waits;
+			st->waits = w;
+		} else {
+			got = -1;
+		}
+	}
+	if (got != EAIO_RA_AGAIN) {
+		eaio_ra_consume(st, req->offset + req->count);
+	}
+	eaio_ra_refill(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if (got == EAIO_RA_AGAIN) {
+		return 0;
+	}
+	if (got >= 0) {
+		__atomic_add_fetch(&ra->stats.hits, 1, __ATOMIC_RELAXED);
+		req->done(got, req->usr);
+		return 0;
+	}
+	__atomic_add_fetch(&ra->stats.misses, 1, __ATOMIC_RELAXED);
+	return eaio_filter_submit_next(flt, req);
+}
+
+static const struct eaio_filter_ops eaio_ra_ops = {
+	.name = "readahead",
+	.rdwt = eaio_ra_rdwt,
+	.submit = eaio_ra_submit,
+	.invalidate = eaio_ra_invalidate,
+};
+
+struct eaio_ra *eaio_ra_create(struct eaio_context *aio_ctx, const struct eaio_ra_attr *attr)
+{
+	int nstreams = (attr && (attr->streams > 0)) ? attr->streams : EAIO_RA_STREAMS;
+	int depth = (attr && (attr->depth > 0)) ? attr->depth : EAIO_RA_DEPTH;
+
+	struct eaio_ra *ra = calloc(1, sizeof(*ra) + nstreams * sizeof(struct eaio_ra_stream));
+	if (!ra) {
+		return NULL;
+	}
+	ra->depth = depth;
+	ra->trigger = (attr && (attr->trigger > 0)) ? attr->trigger : EAIO_RA_TRIGGER;
+	ra->prio = (attr && attr->prio) ? attr->prio : EAIO_PRIO_MAX - 1;
+	ra->align = (attr && attr->align) ? attr->align : EAIO_RA_ALIGN;
+	ra->window = (attr && attr->window) ? attr->window : EAIO_RA_WINDOW;
+	ra->window = roundup_to(ra->window, ra->align);
+	ra->pool = attr ? attr->pool : NULL;
+	ra->nstreams = nstreams;
+
+	struct eaio_ra_buf *bufs = calloc(nstreams * depth, sizeof(struct eaio_ra_buf));
+	if (!bufs) {
+		free(ra);
+		return NULL;
+	}
+	for (int i = 0; i < nstreams; i++) {
+		struct eaio_ra_stream *st = &ra->streams[i];
+
+		st->ra = ra;
+		st->fd = -1;
+		pthread_mutex_init(&st->lock, NULL);
+		pthread_cond_init(&st->cond, NULL);
+		st->buf = &bufs[i * depth];
+		for (int j = 0; j < depth; j++) {
+			st->buf[j].st = st;
+		}
+	}
+
+	eaio_context_push_filter(aio_ctx, &ra->filter, &eaio_ra_ops);
+	return ra;
+}
+
+void eaio_ra_destroy(struct eaio_ra *ra)
+{
+	eaio_context_remove_filter(ra->filter.aio_ctx, &ra->filter);
+
+	for (int i = 0; i < ra->nstreams; i++) {
+		struct eaio_ra_stream *st = &ra->streams[i];
+
+		pthread_mutex_lock(&st->lock);
+		while (st->loading > 0) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		eaio_ra_drop(st, 0, 0);
+		pthread_mutex_unlock(&st->lock);
+
+		for (int j = 0; j < ra->depth; j++) {
+			struct eaio_ra_buf *buf = &st->buf[j];
+			if (!buf->data) {
+				continue;
+			}
+			if (ra->pool) {
+				eaio_bufpool_free(ra->pool, buf->data);
+			} else {
+				free(buf->data);
+			}
+		}
+		pthread_cond_destroy(&st->cond);
+		pthread_mutex_destroy(&st->lock);
+	}
+	free(ra->streams[0].buf);
+	free(ra);
+}
+
+void eaio_ra_stats(struct eaio_ra *ra, struct eaio_ra_stats *stats)
+{
+	stats->hits = __atomic_load_n(&ra->stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&ra->stats.misses, __ATOMIC_RELAXED);
+	stats->prefetched = __atomic_load_n(&ra->stats.prefetched, __ATOMIC_RELAXED);
+	stats->wasted = __atomic_load_n(&ra->stats.wasted, __ATOMIC_RELAXED);
+}
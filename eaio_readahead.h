@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eaio_api.h"
+#include "eaio_bufpool.h"
+
+struct eaio_ra_attr {
+	size_t window;	/*bytes per prefetch read of a sequential stream, default 256KB*/
+	int depth;	/*prefetch buffers per stream, default 4*/
+	int streams;	/*fds followed at once, fd takes the slot fd % streams, default 64*/
+	int trigger;	/*reads in a row keeping a pattern before prefetching starts, default 2*/
+	int prio;	/*class of the prefetch reads, default EAIO_PRIO_MAX - 1*/
+	size_t align;	/*of the prefetch offsets and sizes, for O_DIRECT, default 4096*/
+	struct eaio_bufpool *pool;	/*buffers come from here, NULL for posix_memalign*/
+};
+
+struct eaio_ra_stats {
+	uint64_t hits;	/*reads copied from the prefetched buffers*/
+	uint64_t misses;	/*reads sent on to the queues*/
+	uint64_t prefetched;	/*bytes read ahead*/
+	uint64_t wasted;	/*bytes read ahead and dropped unread*/
+};
+
+struct eaio_ra;
+
+/*
+ * Read-ahead filter on aio_ctx, see eaio_filter.h. Once the EAIO_OPT_PREAD calls
+ * on an fd move forward sequentially or with a fixed stride, the blocks they are
+ * heading for are read at prio ahead of the caller, and its reads that fall in
+ * them are copied out without going to the queues; an eaio_context_submit() read
+ * catching up with a prefetch is completed when it lands. Writes drop what they
+ * overlap.
+ */
+struct eaio_ra *eaio_ra_create(struct eaio_context *aio_ctx, const struct eaio_ra_attr *attr);
+
+/*after the last request is done and while the queues still run, it waits for the prefetches*/
+void eaio_ra_destroy(struct eaio_ra *ra);
+
+void eaio_ra_stats(struct eaio_ra *ra, struct eaio_ra_stats *stats);
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "eaio_stats.h"
+
+static inline uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static uint64_t eaio_hist_upper(int idx)
+{
+	if (idx < EAIO_HIST_SUB) {
+		return idx;
+	}
+	int g = idx / EAIO_HIST_SUB;
+	int s = idx % EAIO_HIST_SUB;
+	return ((uint64_t)(EAIO_HIST_SUB + s + 1) << (g - 1)) - 1;
+}
+
+uint64_t eaio_hist_percentile(const struct eaio_hist *h, double p)
+{
+	uint64_t count = load(&h->count);
+	if (!count) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(count * p / 100.0 + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	uint64_t seen = 0;
+	uint64_t max = load(&h->max);
+	for (int i = 0; i < EAIO_HIST_BUCKETS; i++) {
+		seen += load(&h->bucket[i]);
+		if (seen >= rank) {
+			uint64_t v = eaio_hist_upper(i);
+			return (v < max) ? v : max;
+		}
+	}
+	/*raced with the writer, count ran ahead of the buckets*/
+	return max;
+}
+
+void eaio_hist_merge(struct eaio_hist *dst, const struct eaio_hist *src)
+{
+	/*buckets first, so a live src never shows fewer samples in them than in count*/
+	for (int i = 0; i < EAIO_HIST_BUCKETS; i++) {
+		dst->bucket[i] += load(&src->bucket[i]);
+	}
+	dst->count += load(&src->count);
+	dst->sum += load(&src->sum);
+
+	uint64_t max = load(&src->max);
+	if (max > dst->max) {
+		dst->max = max;
+	}
+}
+
+void eaio_qstats_merge(struct eaio_qstats *dst, const struct eaio_qstats *src)
+{
+	dst->submitted += load(&src->submitted);
+	dst->iocbs += load(&src->iocbs);
+	dst->submit_errors += load(&src->submit_errors);
+	dst->retries += load(&src->retries);
+	dst->timeouts += load(&src->timeouts);
+	dst->cancels += load(&src->cancels);
+	dst->completed += load(&src->completed);
+	dst->errors += load(&src->errors);
+	dst->bytes += load(&src->bytes);
+	dst->queued += load(&src->queued);
+
+	dst->rounds += load(&src->rounds);
+	dst->inflight_sum += load(&src->inflight_sum);
+	uint64_t max = load(&src->inflight_max);
+	if (max > dst->inflight_max) {
+		dst->inflight_max = max;
+	}
+
+	dst->inflight += load(&src->inflight);
+	dst->allowed += load(&src->allowed);
+	dst->depth += load(&src->depth);
+
+	eaio_hist_merge(&dst->wait, &src->wait);
+	eaio_hist_merge(&dst->service, &src->service);
+	for (int i = 0; i < EAIO_STATS_PRIO_MAX; i++) {
+		struct eaio_cstats *d = &dst->cls[i];
+		const struct eaio_cstats *s = &src->cls[i];
+
+		d->submitted += load(&s->submitted);
+		d->completed += load(&s->completed);
+		d->errors += load(&s->errors);
+		d->bytes += load(&s->bytes);
+		eaio_hist_merge(&d->lat, &s->lat);
+	}
+}
+
+static void eaio_hist_print(FILE *fp, const char *name, const struct eaio_hist *h)
+{
+	fprintf(fp, "  %-8s n=%lu avg=%.1f p50=%.1f p99=%.1f p999=%.1f max=%.1f\n", name,
+		h->count, h->count ? h->sum / 1000.0 / h->count : 0.0,
+		eaio_hist_percentile(h, 50) / 1000.0,
+		eaio_hist_percentile(h, 99) / 1000.0,
+		eaio_hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
+
+void eaio_qstats_print(FILE *fp, const char *name, const struct eaio_qstats *st)
+{
+	fprintf(fp, "%s: submitted=%lu iocbs=%lu completed=%lu errors=%lu submit_errors=%lu retries=%lu bytes=%lu\n",
+		name, st->submitted, st->iocbs, st->completed, st->errors, st->submit_errors, st->retries, st->bytes);
+	fprintf(fp, "  timeouts=%lu cancels=%lu\n", st->timeouts, st->cancels);
+	fprintf(fp, "  inflight=%lu allowed=%lu depth=%lu queued=%lu occupancy avg=%.1f max=%lu\n",
+		st->inflight, st->allowed, st->depth, st->queued,
+		st->rounds ? (double)st->inflight_sum / st->rounds : 0.0, st->inflight_max);
+	eaio_hist_print(fp, "wait", &st->wait);
+	eaio_hist_print(fp, "service", &st->service);
+	for (int i = 0; i < EAIO_STATS_PRIO_MAX; i++) {
+		const struct eaio_cstats *cs = &st->cls[i];
+		char label[16];
+
+		if (!cs->submitted && !cs->completed) {
+			continue;
+		}
+		snprintf(label, sizeof(label), "prio%d", i);
+		fprintf(fp, "  %-8s submitted=%lu completed=%lu errors=%lu bytes=%lu\n",
+			label, cs->submitted, cs->completed, cs->errors, cs->bytes);
+		eaio_hist_print(fp, "", &cs->lat);
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define EAIO_STATS_PRIO_MAX     8	/*same as EAIO_PRIO_MAX*/
+
+/*
+ * Log-linear histogram of nanoseconds: values below 16 have a bucket each,
+ * every power of two above is split in 16, so any bucket is within 1/16 of
+ * its values. Everything from 2^40ns (about 18 minutes) up lands in the last one.
+ */
+#define EAIO_HIST_SUB_BITS      4
+#define EAIO_HIST_SUB           (1 << EAIO_HIST_SUB_BITS)
+#define EAIO_HIST_EXP_MAX       40
+#define EAIO_HIST_BUCKETS       ((EAIO_HIST_EXP_MAX - EAIO_HIST_SUB_BITS + 2) * EAIO_HIST_SUB)
+
+struct eaio_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[EAIO_HIST_BUCKETS];
+};
+
+struct eaio_cstats {
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t errors;	/*completed with a negative result*/
+	uint64_t bytes;	/*sum of the positive results*/
+	struct eaio_hist lat;	/*enqueue to completion*/
+};
+
+struct eaio_qstats {
+	uint64_t submitted;	/*requests handed to the engine*/
+	uint64_t iocbs;	/*engine entries, fewer than submitted when merging*/
+	uint64_t submit_errors;	/*refused by io_submit or the ring*/
+	uint64_t retries;	/*EINTR/EAGAIN completions queued again*/
+	uint64_t timeouts;	/*requests past their deadline*/
+	uint64_t cancels;	/*requests hit by eaio_context_cancel()*/
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t queued;	/*waiting in the queue now*/
+
+	/*inflight sampled after every dispatch round*/
+	uint64_t rounds;
+	uint64_t inflight_sum;
+	uint64_t inflight_max;
+
+	/*gauges, only filled in by eaio_context_stats()*/
+	uint64_t inflight;
+	uint64_t allowed;
+	uint64_t depth;
+
+	struct eaio_hist wait;	/*enqueue to submit*/
+	struct eaio_hist service;	/*submit to completion of each engine entry*/
+	struct eaio_cstats cls[EAIO_STATS_PRIO_MAX];
+};
+
+/*
+ * Every counter of a queue is written by its executor only, so a relaxed store
+ * is enough and readers on other threads never see a torn value.
+ */
+static inline void eaio_stat_add(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static inline void eaio_stat_sub(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, *p - v, __ATOMIC_RELAXED);
+}
+
+static inline int eaio_hist_index(uint64_t v)
+{
+	if (v < EAIO_HIST_SUB) {
+		return v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	if (e > EAIO_HIST_EXP_MAX) {
+		return EAIO_HIST_BUCKETS - 1;
+	}
+	return (e - EAIO_HIST_SUB_BITS + 1) * EAIO_HIST_SUB + ((v >> (e - EAIO_HIST_SUB_BITS)) & (EAIO_HIST_SUB - 1));
+}
+
+static inline void eaio_hist_add(struct eaio_hist *h, uint64_t v)
+{
+	eaio_stat_add(&h->bucket[eaio_hist_index(v)], 1);
+	eaio_stat_add(&h->count, 1);
+	eaio_stat_add(&h->sum, v);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+/*upper bound of the bucket holding the p-th (0-100) percentile, at most the max seen*/
+uint64_t eaio_hist_percentile(const struct eaio_hist *h, double p);
+
+/*adds src to dst, src may be live*/
+void eaio_hist_merge(struct eaio_hist *dst, const struct eaio_hist *src);
+
+void eaio_qstats_merge(struct eaio_qstats *dst, const struct eaio_qstats *src);
+
+/*human readable dump, latencies in usec*/
+void eaio_qstats_print(FILE *fp, const char *name, const struct eaio_qstats *st);
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "eaio_trace.h"
+
+struct eaio_trace *eaio_trace_create(int size)
+{
+	uint64_t nr = 1;
+	while (nr < (uint64_t)size) {
+		nr <<= 1;
+	}
+
+	struct eaio_trace *trace = calloc(1, sizeof(*trace) + nr * sizeof(struct eaio_trace_rec));
+	if (!trace) {
+		return NULL;
+	}
+	trace->head = 0;
+	trace->mask = nr - 1;
+	return trace;
+}
+
+void eaio_trace_free(struct eaio_trace *trace)
+{
+	free(trace);
+}
+
+int eaio_trace_snapshot(struct eaio_trace *trace, struct eaio_trace_rec *recs, int max)
+{
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t nr = trace->mask + 1;
+	uint64_t from = (head > nr) ? (head - nr) : 0;
+	if (head - from > (uint64_t)max) {
+		from = head - max;
+	}
+
+	int cnt = 0;
+	for (uint64_t pos = from; pos < head; pos++) {
+		struct eaio_trace_rec *rec = &trace->recs[pos & trace->mask];
+		uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+		/*not published yet, or already reused by a newer event*/
+		if (seq != pos + 1) {
+			continue;
+		}
+		recs[cnt] = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		cnt++;
+	}
+	return cnt;
+}
+
+static const char *eaio_trace_name(uint16_t type)
+{
+	switch (type) {
+		case EAIO_TRACE_ENQUEUE:
+			return "enqueue";
+		case EAIO_TRACE_DRAIN:
+			return "drain";
+		case EAIO_TRACE_DISPATCH:
+			return "dispatch";
+		case EAIO_TRACE_COMPLETE:
+			return "complete";
+		default:
+			return "unknown";
+	}
+}
+
+void eaio_trace_print(FILE *fp, const struct eaio_trace_rec *recs, int nr, enum eaio_trace_format format)
+{
+	uint64_t base = nr ? recs[0].ts : 0;
+
+	for (int i = 1; i < nr; i++) {
+		if (recs[i].ts < base) {
+			base = recs[i].ts;
+		}
+	}
+
+	if (format == EAIO_TRACE_JSON) {
+		fprintf(fp, "[\n");
+	}
+	for (int i = 0; i < nr; i++) {
+		const struct eaio_trace_rec *rec = &recs[i];
+
+		if (format == EAIO_TRACE_JSON) {
+			fprintf(fp, "  {\"seq\": %lu, \"ts_ns\": %lu, \"event\": \"%s\", \"task\": \"%#lx\", "
+				"\"prio\": %u, \"op\": %u, \"fd\": %d, \"offset\": %ld, \"size\": %u, \"result\": %d}%s\n",
+				rec->seq, rec->ts - base, eaio_trace_name(rec->type), rec->task,
+				rec->prio, rec->opcode, rec->fd, rec->offset, rec->size, rec->result,
+				(i + 1 < nr) ? "," : "");
+		} else {
+			fprintf(fp, "%12.3f %-8s task=%#lx prio=%u op=%u fd=%d off=%ld size=%u res=%d\n",
+				(rec->ts - base) / 1000.0, eaio_trace_name(rec->type), rec->task,
+				rec->prio, rec->opcode, rec->fd, rec->offset, rec->size, rec->result);
+		}
+	}
+	if (format == EAIO_TRACE_JSON) {
+		fprintf(fp, "]\n");
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Lifecycle of a request: ENQUEUE is stamped by the caller, DRAIN when the
+ * executor woke up and took it from the inbox, DISPATCH when it was handed to
+ * the engine and COMPLETE when its result came back (also for -EAGAIN retries).
+ */
+enum eaio_trace_type {
+	EAIO_TRACE_ENQUEUE = 1,
+	EAIO_TRACE_DRAIN = 2,
+	EAIO_TRACE_DISPATCH = 3,
+	EAIO_TRACE_COMPLETE = 4
+};
+
+enum eaio_trace_format {
+	EAIO_TRACE_TEXT = 0,
+	EAIO_TRACE_JSON = 1	/*one array of objects, ordered by seq*/
+};
+
+struct eaio_trace_rec {
+	uint64_t seq;	/*position in the ring + 1, 0 while being written*/
+	uint64_t ts;	/*CLOCK_MONOTONIC nsec*/
+	uint64_t task;	/*same value for every event of one request*/
+	int64_t offset;
+	uint32_t size;
+	int32_t result;
+	int32_t fd;
+	uint16_t type;
+	uint8_t prio;
+	uint8_t opcode;	/*iocb aio_lio_opcode*/
+};
+
+struct eaio_trace {
+	uint64_t head;	/*next position, advanced by any thread*/
+	uint64_t mask;
+	struct eaio_trace_rec recs[];
+};
+
+/*size is rounded up to a power of two records*/
+struct eaio_trace *eaio_trace_create(int size);
+
+void eaio_trace_free(struct eaio_trace *trace);
+
+/*
+ * Lock free for any number of writers, the oldest records are overwritten.
+ * A record is valid once its seq is published, readers drop the torn ones.
+ */
+static inline void eaio_trace_record(struct eaio_trace *trace, uint16_t type, uint64_t ts, const void *task,
+		int fd, int64_t offset, uint32_t size, int32_t result, uint8_t prio, uint8_t opcode)
+{
+	uint64_t pos = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	struct eaio_trace_rec *rec = &trace->recs[pos & trace->mask];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->ts = ts;
+	rec->task = (uintptr_t)task;
+	rec->offset = offset;
+	rec->size = size;
+	rec->result = result;
+	rec->fd = fd;
+	rec->type = type;
+	rec->prio = prio;
+	rec->opcode = opcode;
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy at most max of the newest valid records into recs, oldest first.
+ * Return the number copied.
+ */
+int eaio_trace_snapshot(struct eaio_trace *trace, struct eaio_trace_rec *recs, int max);
+
+/*timeline of recs relative to the first one*/
+void eaio_trace_print(FILE *fp, const struct eaio_trace_rec *recs, int nr, enum eaio_trace_format format);
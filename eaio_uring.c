@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "eaio_logger.h"
+#include "eaio_engine.h"
+
+/*raw io_uring without liburing, only what eaio_queue needs*/
+struct eaio_uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+static int _uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int _uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void _uring_unmap(struct eaio_uring *ring)
+{
+	if (ring->sqes && (ring->sqes != MAP_FAILED)) {
+		munmap(ring->sqes, ring->sqes_sz);
+	}
+	if (ring->cq_ring && (ring->cq_ring != MAP_FAILED) && (ring->cq_ring != ring->sq_ring)) {
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	}
+	if (ring->sq_ring && (ring->sq_ring != MAP_FAILED)) {
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	}
+}
+
+static int uring_setup(struct eaio_queue *qaio, int depth)
+{
+	struct eaio_uring *ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		return -1;
+	}
+
+	struct io_uring_params p = {};
+	ring->fd = _uring_setup(depth, &p);
+	if (ring->fd < 0) {
+		eaio_printf(LOG_ERR, "io_uring_setup failed: %m");
+		free(ring);
+		return -1;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz) {
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		}
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			goto fail;
+		}
+	}
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	int efd = qaio->o_efd;
+	if (_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+		goto fail;
+	}
+
+	qaio->uring = ring;
+	return 0;
+fail:
+	eaio_printf(LOG_ERR, "io_uring ring setup failed: %m");
+	_uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	return -1;
+}
+
+static void uring_destroy(struct eaio_queue *qaio)
+{
+	struct eaio_uring *ring = qaio->uring;
+
+	_uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	qaio->uring = NULL;
+}
+
+static void _uring_prep(struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = iocb->aio_fildes;
+	sqe->user_data = (uintptr_t)iocb->data;
+
+	switch (iocb->aio_lio_opcode) {
+		case IO_CMD_PREAD:
+			sqe->opcode = IORING_OP_READ;
+			break;
+		case IO_CMD_PWRITE:
+			sqe->opcode = IORING_OP_WRITE;
+			break;
+		case IO_CMD_PREADV:
+			sqe->opcode = IORING_OP_READV;
+			break;
+		case IO_CMD_PWRITEV:
+			sqe->opcode = IORING_OP_WRITEV;
+			break;
+		case IO_CMD_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			return;
+		case IO_CMD_FDSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			return;
+		case IO_CMD_POLL:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll_events = iocb->u.poll.events;
+			return;
+		default:
+			assert(0);
+	}
+	/*io_iocb_common and io_iocb_vector share the buf/nbytes/offset layout*/
+	sqe->addr = (uintptr_t)iocb->u.c.buf;
+	sqe->len = iocb->u.c.nbytes;
+	sqe->off = iocb->u.c.offset;
+}
+
+static int uring_submit(struct eaio_queue *qaio, struct iocb *iocbp[], int nr)
+{
+	struct eaio_uring *ring = qaio->uring;
+
+	unsigned mask = *ring->sq_mask;
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned room = (mask + 1) - (tail - head);
+	if ((unsigned)nr > room) {
+		nr = room;
+	}
+	if (nr == 0) {
+		return -EAGAIN;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		unsigned idx = (tail + i) & mask;
+		_uring_prep(&ring->sqes[idx], iocbp[i]);
+		ring->sq_array[idx] = idx;
+	}
+	__atomic_store_n(ring->sq_tail, tail + nr, __ATOMIC_RELEASE);
+
+	int ret;
+	do {
+		ret = _uring_enter(ring->fd, nr, 0, 0);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0) {
+		/*nothing was consumed, take the entries back*/
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		return -errno;
+	}
+	if (ret < nr) {
+		/*the caller submits the rest again*/
+		__atomic_store_n(ring->sq_tail, tail + ret, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+
+static int uring_getevents(struct eaio_queue *qaio, struct io_event *events, int nr)
+{
+	struct eaio_uring *ring = qaio->uring;
+
+	unsigned mask = *ring->cq_mask;
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	int done = 0;
+	for (; (head != tail) && (done < nr); head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & mask];
+
+		/*the outcome of an IORING_OP_ASYNC_CANCEL, the target reports itself*/
+		if (!cqe->user_data) {
+			continue;
+		}
+		memset(&events[done], 0, sizeof(struct io_event));
+		events[done].data = (void *)(uintptr_t)cqe->user_data;
+		events[done].res = (long)cqe->res;
+		done++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+static int uring_cancel(struct eaio_queue *qaio, struct iocb *iocb, struct io_event *ev)
+{
+	struct eaio_uring *ring = qaio->uring;
+
+	unsigned mask = *ring->sq_mask;
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head > mask) {
+		return -EAGAIN;
+	}
+
+	unsigned idx = tail & mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)iocb->data;
+	sqe->user_data = 0;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	int ret;
+	do {
+		ret = _uring_enter(ring->fd, 1, 0, 0);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 1) {
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		return (ret < 0) ? -errno : -EAGAIN;
+	}
+	return 0;
+}
+
+const struct eaio_engine_ops eaio_engine_uring = {
+	.name = "uring",
+	.setup = uring_setup,
+	.destroy = uring_destroy,
+	.submit = uring_submit,
+	.getevents = uring_getevents,
+	.cancel = uring_cancel,
+};
@@ -0,0 +1,1218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "eaio_logger.h"
+#include "eaio_filter.h"
+#include "eaio_writeback.h"
+
+#define EAIO_WB_EXTENT          (1UL << 20)
+#define EAIO_WB_SECTOR          4096
+#define EAIO_WB_CAPACITY        (64UL << 20)
+#define EAIO_WB_MAX_ABSORB      (64UL << 10)
+#define EAIO_WB_MAX_AGE         1000
+#define EAIO_WB_MAX_SECTORS     4096	/*of an extent, bounds the bitmaps*/
+#define EAIO_WB_FILES           64
+
+enum eaio_wb_where {
+	EAIO_WB_FREE = 0,
+	EAIO_WB_CLEAN = 1,	/*most recently used first*/
+	EAIO_WB_DIRTY = 2	/*first dirtied first*/
+};
+
+struct eaio_wb_extent {
+	struct hlist_node hnode;
+	struct list_node lnode;	/*on free, clean or dirty*/
+	enum eaio_wb_where where;
+	int fd;
+	int qnum;	/*of the last write into it*/
+	uint64_t idx;	/*offset / extent*/
+	uint64_t since;	/*ns it went dirty*/
+	size_t tail;	/*bytes from its start known to be in the file*/
+	int ndirty;	/*sectors*/
+	int users;	/*pinned while the lock is dropped for it*/
+	bool flushing;
+	uint64_t valid[EAIO_WB_MAX_SECTORS / 64];	/*sectors holding the file's data*/
+	uint64_t dirty[EAIO_WB_MAX_SECTORS / 64];	/*those not written back yet*/
+	char *data;	/*allocated on first use*/
+};
+
+/*what the write-back knows of an fd, looked up on its first write*/
+struct eaio_wb_file {
+	int fd;	/*-1 for none*/
+	bool direct;	/*O_DIRECT on a file, not a block device*/
+	off_t size;	/*grown by the writes going down past it*/
+};
+
+struct eaio_wb {
+	struct eaio_filter filter;
+	size_t extent;
+	size_t sector;
+	int shift;	/*of extent*/
+	int sshift;	/*of sector*/
+	int nsec;	/*sectors an extent*/
+	size_t max_absorb;
+	uint64_t max_age_ns;
+	int prio;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/*an extent was unpinned or done flushing*/
+	pthread_cond_t kick;	/*wakes the flusher, on CLOCK_MONOTONIC*/
+	pthread_t flusher;
+	bool stop;
+
+	uint64_t hmask;
+	struct hlist_head *hash;
+	struct list_head free;
+	struct list_head clean;
+	struct list_head dirty;
+	int ndirty;	/*extents*/
+	int nextents;
+	struct eaio_wb_extent *extents;
+	struct eaio_wb_file files[EAIO_WB_FILES];	/*by fd, a newer one takes the slot*/
+
+	/*async requests waiting for a write-out of their range, first in first out*/
+	struct eaio_wb_park *parked;
+	struct eaio_wb_park **ptail;
+
+	struct eaio_wb_stats stats;	/*atomic*/
+};
+
+struct eaio_wb_park {
+	struct eaio_wb_park *next;
+	struct eaio_filter_req req;
+	int error;	/*to fail it with instead, once it is let go*/
+};
+
+/*an async write-out of an extent, its runs go down as eaio_context_submit() writes*/
+struct eaio_wb_out {
+	struct eaio_wb_out *next;	/*on the list of those to start*/
+	struct eaio_wb *wb;
+	struct eaio_wb_extent *ext;	/*pinned*/
+	uint64_t since;
+	size_t tail;
+	int left;	/*atomic, the runs in flight and one for the submitter*/
+	int error;
+	size_t want;
+	size_t got;	/*atomic*/
+	uint64_t bits[EAIO_WB_MAX_SECTORS / 64];
+};
+
+static inline uint64_t eaio_wb_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void eaio_wb_count(uint64_t *p, uint64_t v)
+{
+	__atomic_add_fetch(p, v, __ATOMIC_RELAXED);
+}
+
+static inline bool eaio_wb_test(const uint64_t *map, int s)
+{
+	return (map[s >> 6] >> (s & 63)) & 1;
+}
+
+static inline void eaio_wb_set(uint64_t *map, int s)
+{
+	map[s >> 6] |= 1ULL << (s & 63);
+}
+
+static inline void eaio_wb_clear(uint64_t *map, int s)
+{
+	map[s >> 6] &= ~(1ULL << (s & 63));
+}
+
+static inline uint64_t eaio_wb_hash(int fd, uint64_t idx)
+{
+	uint64_t h = ((uint64_t)fd * 0x9e3779b97f4a7c15ULL) ^ (idx * 0xc2b2ae3d27d4eb4fULL);
+	return h ^ (h >> 29);
+}
+
+static struct eaio_wb_extent *eaio_wb_find(struct eaio_wb *wb, int fd, uint64_t idx)
+{
+	struct eaio_wb_extent *ext;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(ext, pos, &wb->hash[eaio_wb_hash(fd, idx) & wb->hmask], hnode) {
+		if ((ext->fd == fd) && (ext->idx == idx)) {
+			return ext;
+		}
+	}
+	return NULL;
+}
+
+static inline bool eaio_wb_busy(const struct eaio_wb_extent *ext)
+{
+	return ext->users || ext->flushing;
+}
+
+static void eaio_wb_unpin(struct eaio_wb *wb, struct eaio_wb_extent *ext)
+{
+	assert(ext->users > 0);
+	if (!--ext->users) {
+		pthread_cond_broadcast(&wb->cond);
+	}
+}
+
+static void eaio_wb_mark_dirty(struct eaio_wb *wb, struct eaio_wb_extent *ext, int s)
+{
+	if (eaio_wb_test(ext->dirty, s)) {
+		return;
+	}
+	eaio_wb_set(ext->dirty, s);
+	ext->ndirty++;
+	if (ext->where != EAIO_WB_DIRTY) {
+		list_del(&ext->lnode);
+		list_add_tail(&ext->lnode, &wb->dirty);
+		ext->where = EAIO_WB_DIRTY;
+		ext->since = eaio_wb_clock();
+		wb->ndirty++;
+	}
+	if ((ext->ndirty == wb->nsec) || (wb->ndirty * 2 > wb->nextents)) {
+		pthread_cond_signal(&wb->kick);
+	}
+}
+
+/*take the dirty bits of ext into bits for a write-out, called locked*/
+static uint64_t eaio_wb_take(struct eaio_wb *wb, struct eaio_wb_extent *ext, uint64_t *bits)
+{
+	int words = (wb->nsec + 63) / 64;
+	uint64_t since = ext->since;
+
+	memcpy(bits, ext->dirty, words * sizeof(uint64_t));
+	memset(ext->dirty, 0, words * sizeof(uint64_t));
+	ext->ndirty = 0;
+	list_del(&ext->lnode);
+	list_add(&ext->lnode, &wb->clean);
+	ext->where = EAIO_WB_CLEAN;
+	wb->ndirty--;
+	ext->flushing = true;
+	return since;
+}
+
+/*end a write-out, called locked; on error what it took is dirty again*/
+static void eaio_wb_untake(struct eaio_wb *wb, struct eaio_wb_extent *ext, const uint64_t *bits,
+		uint64_t since, int error)
+{
+	if (error) {
+		/*keep it all dirty, the next flush tries again*/
+		for (int s = 0; s < wb->nsec; s++) {
+			if (eaio_wb_test(bits, s) && !eaio_wb_test(ext->dirty, s)) {
+				eaio_wb_set(ext->dirty, s);
+				ext->ndirty++;
+			}
+		}
+		if (ext->where != EAIO_WB_DIRTY) {
+			list_del(&ext->lnode);
+			list_add(&ext->lnode, &wb->dirty);
+			ext->where = EAIO_WB_DIRTY;
+			wb->ndirty++;
+		}
+		ext->since = since;
+	}
+	ext->flushing = false;
+	pthread_cond_broadcast(&wb->cond);
+}
+
+/*
+ * The next run of sectors set in bits from *s on, as bytes of the extent, the
+ * last one stopping where the file does; false when there is none left.
+ */
+static bool eaio_wb_run(struct eaio_wb *wb, const uint64_t *bits, size_t tail, int *s,
+		size_t *from, size_t *to)
+{
+	while (*s < wb->nsec) {
+		if (!eaio_wb_test(bits, *s)) {
+			(*s)++;
+			continue;
+		}
+		int e = *s;
+		while ((e < wb->nsec) && eaio_wb_test(bits, e)) {
+			e++;
+		}
+		*from = (size_t)*s << wb->sshift;
+		*to = (size_t)e << wb->sshift;
+		*s = e;
+		if (*to > tail) {
+			*to = tail;
+		}
+		if (*to > *from) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void eaio_wb_resume(struct eaio_wb *wb, const struct eaio_wb_extent *ext, int error);
+
+/*
+ * Called locked with ext pinned, returns locked. The dirty bits are taken before
+ * the lock is dropped, a write landing meanwhile dirties its sectors again.
+ */
+static int eaio_wb_writeout(struct eaio_wb *wb, struct eaio_wb_extent *ext)
+{
+	uint64_t bits[EAIO_WB_MAX_SECTORS / 64];
+
+	while (ext->flushing) {
+		pthread_cond_wait(&wb->cond, &wb->lock);
+	}
+	if (ext->where != EAIO_WB_DIRTY) {
+		return 0;
+	}
+
+	uint64_t since = eaio_wb_take(wb, ext, bits);
+	struct eaio_filter_req req = {
+		.opt = EAIO_OPT_PWRITE,
+		.qnum = ext->qnum,
+		.prio = wb->prio,
+		.fd = ext->fd,
+	};
+	off_t base = (off_t)ext->idx << wb->shift;
+	size_t tail = ext->tail;
+	pthread_mutex_unlock(&wb->lock);
+
+	/*one write per run of dirty sectors*/
+	int error = 0;
+	size_t from, to;
+	for (int s = 0; eaio_wb_run(wb, bits, tail, &s, &from, &to);) {
+		req.buf = ext->data + from;
+		req.count = to - from;
+		req.offset = base + from;
+		int ret = eaio_filter_next(&wb->filter, &req);
+		eaio_wb_count(&wb->stats.flushes, 1);
+		if (ret != (int)req.count) {
+			error = (ret < 0) ? errno : EIO;
+			break;
+		}
+		eaio_wb_count(&wb->stats.flushed, ret);
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	eaio_wb_untake(wb, ext, bits, since, error);
+	eaio_wb_resume(wb, ext, error);
+	return -error;
+}
+
+static void eaio_wb_release(struct eaio_wb *wb, struct eaio_wb_extent *ext)
+{
+	assert(!eaio_wb_busy(ext));
+	if (ext->where == EAIO_WB_DIRTY) {
+		wb->ndirty--;
+	}
+	hlist_del(&ext->hnode);
+	list_del(&ext->lnode);
+	list_add(&ext->lnode, &wb->free);
+	ext->where = EAIO_WB_FREE;
+}
+
+/*
+ * The extent of (fd, idx), pinned, taking the least recently used clean one or
+ * writing out the oldest dirty one when none is free. Called locked, NULL with
+ * errno set when no memory or the write-back fails, or EAGAIN without wait
+ * when there is no room but by a write-out.
+ */
+static struct eaio_wb_extent *eaio_wb_get(struct eaio_wb *wb, int fd, uint64_t idx, bool wait)
+{
+	struct eaio_wb_extent *ext;
+
+	for (;;) {
+		ext = eaio_wb_find(wb, fd, idx);
+		if (ext) {
+			if (ext->where == EAIO_WB_CLEAN) {
+				list_move(&ext->lnode, &wb->clean);
+			}
+			ext->users++;
+			return ext;
+		}
+
+		struct eaio_wb_extent *victim = NULL;
+		if (!list_empty(&wb->free)) {
+			victim = list_first_entry(&wb->free, struct eaio_wb_extent, lnode);
+		} else {
+			list_for_each_entry_reverse(ext, &wb->clean, lnode) {
+				if (!eaio_wb_busy(ext)) {
+					victim = ext;
+					break;
+				}
+			}
+			if (victim) {
+				eaio_wb_release(wb, victim);
+			}
+		}
+		if (victim) {
+			if (!victim->data && posix_memalign((void **)&victim->data, wb->sector, wb->extent)) {
+				victim->data = NULL;
+				errno = ENOMEM;
+				return NULL;
+			}
+			list_del(&victim->lnode);
+			list_add(&victim->lnode, &wb->clean);
+			hlist_add_head(&victim->hnode, &wb->hash[eaio_wb_hash(fd, idx) & wb->hmask]);
+			victim->where = EAIO_WB_CLEAN;
+			victim->fd = fd;
+			victim->idx = idx;
+			victim->tail = 0;
+			victim->ndirty = 0;
+			memset(victim->valid, 0, sizeof(victim->valid));
+			memset(victim->dirty, 0, sizeof(victim->dirty));
+			victim->users = 1;
+			return victim;
+		}
+		if (!wait) {
+			pthread_cond_signal(&wb->kick);
+			errno = EAGAIN;
+			return NULL;
+		}
+
+		list_for_each_entry(ext, &wb->dirty, lnode) {
+			if (!eaio_wb_busy(ext)) {
+				victim = ext;
+				break;
+			}
+		}
+		if (victim) {
+			/*the writer pays for the room it needs, it becomes clean then free*/
+			victim->users++;
+			int ret = eaio_wb_writeout(wb, victim);
+			eaio_wb_unpin(wb, victim);
+			if (ret < 0) {
+				errno = -ret;
+				return NULL;
+			}
+			continue;
+		}
+		pthread_cond_wait(&wb->cond, &wb->lock);
+	}
+}
+
+/*read sector s of a pinned extent in, called and returns locked*/
+static int eaio_wb_fill(struct eaio_wb *wb, struct eaio_wb_extent *ext, int s, int prio)
+{
+	char *tmp;
+
+	if (posix_memalign((void **)&tmp, wb->sector, wb->sector)) {
+		return -ENOMEM;
+	}
+	struct eaio_filter_req req = {
+		.opt = EAIO_OPT_PREAD,
+		.qnum = ext->qnum,
+		.prio = prio,
+		.fd = ext->fd,
+		.buf = tmp,
+		.count = wb->sector,
+		.offset = ((off_t)ext->idx << wb->shift) + ((off_t)s << wb->sshift),
+	};
+	pthread_mutex_unlock(&wb->lock);
+	int ret = eaio_filter_next(&wb->filter, &req);
+	int error = errno;
+	pthread_mutex_lock(&wb->lock);
+	if (ret < 0) {
+		free(tmp);
+		return -error;
+	}
+
+	/*someone else may have completed it meanwhile*/
+	if (!eaio_wb_test(ext->valid, s)) {
+		size_t at = (size_t)s << wb->sshift;
+		memcpy(ext->data + at, tmp, ret);
+		memset(ext->data + at + ret, 0, wb->sector - ret);
+		eaio_wb_set(ext->valid, s);
+		if (ret && (at + ret > ext->tail)) {
+			ext->tail = at + ret;
+		}
+		eaio_wb_count(&wb->stats.rmw, 1);
+	}
+	free(tmp);
+	return 0;
+}
+
+/*
+ * Copy a small write into the extents, -1 when it has to go down after all.
+ * Without wait it gives up rather than write out or read in anything.
+ */
+static int eaio_wb_absorb(struct eaio_wb *wb, const struct eaio_filter_req *req, bool wait)
+{
+	const char *src = req->buf;
+	off_t at = req->offset;
+	size_t left = req->count;
+
+	pthread_mutex_lock(&wb->lock);
+	while (left) {
+		uint64_t idx = at >> wb->shift;
+		size_t in = at - ((off_t)idx << wb->shift);
+		size_t n = (wb->extent - in < left) ? (wb->extent - in) : left;
+		struct eaio_wb_extent *ext = eaio_wb_get(wb, req->fd, idx, wait);
+		if (!ext) {
+			pthread_mutex_unlock(&wb->lock);
+			return -1;
+		}
+		ext->qnum = req->qnum;
+
+		/*partial sectors at either end are made whole first*/
+		size_t mask = wb->sector - 1;
+		int s0 = in >> wb->sshift;
+		int s1 = (in + n - 1) >> wb->sshift;
+		int ret = 0;
+		if (!wait && (((in & mask) && !eaio_wb_test(ext->valid, s0)) ||
+			(((in + n) & mask) && !eaio_wb_test(ext->valid, s1)))) {
+			ret = -EAGAIN;
+		}
+		if (!ret && (in & mask) && !eaio_wb_test(ext->valid, s0)) {
+			ret = eaio_wb_fill(wb, ext, s0, req->prio);
+		}
+		if (!ret && ((in + n) & mask) && !eaio_wb_test(ext->valid, s1)) {
+			ret = eaio_wb_fill(wb, ext, s1, req->prio);
+		}
+		if (ret < 0) {
+			eaio_wb_unpin(wb, ext);
+			pthread_mutex_unlock(&wb->lock);
+			errno = -ret;
+			return -1;
+		}
+
+		memcpy(ext->data + in, src, n);
+		for (int s = s0; s <= s1; s++) {
+			eaio_wb_set(ext->valid, s);
+			eaio_wb_mark_dirty(wb, ext, s);
+		}
+		if (in + n > ext->tail) {
+			ext->tail = in + n;
+		}
+		eaio_wb_unpin(wb, ext);
+
+		src += n;
+		at += n;
+		left -= n;
+	}
+	pthread_mutex_unlock(&wb->lock);
+	eaio_wb_count(&wb->stats.absorbed, 1);
+	return req->count;
+}
+
+/*the clean sectors of ext in [offset, offset + len), len 0 for all, are not the file's anymore*/
+static void eaio_wb_forget(struct eaio_wb *wb, struct eaio_wb_extent *ext, off_t offset, size_t len)
+{
+	off_t base = (off_t)ext->idx << wb->shift;
+	off_t from = (offset > base) ? offset : base;
+	off_t to = base + wb->extent;
+
+	if (len && (offset + (off_t)len < to)) {
+		to = offset + len;
+	}
+	for (int s = (from - base) >> wb->sshift; s <= (to - 1 - base) >> wb->sshift; s++) {
+		if (!eaio_wb_test(ext->dirty, s)) {
+			eaio_wb_clear(ext->valid, s);
+		}
+	}
+}
+
+/*
+ * Write out the extents of fd overlapping [offset, offset + len), len 0 for the
+ * whole file, or of every fd when fd is negative. With drop the clean sectors
+ * in the range are forgotten too, they are about to be overwritten below.
+ */
+static int eaio_wb_sync(struct eaio_wb *wb, int fd, off_t offset, size_t len, bool drop)
+{
+	uint64_t first = len ? (offset >> wb->shift) : 0;
+	uint64_t last = len ? ((offset + len - 1) >> wb->shift) : UINT64_MAX;
+	int error = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	for (int i = 0; i < wb->nextents; i++) {
+		struct eaio_wb_extent *ext = &wb->extents[i];
+		if ((ext->where == EAIO_WB_FREE) || ((fd >= 0) && (ext->fd != fd)) ||
+			(ext->idx < first) || (ext->idx > last)) {
+			continue;
+		}
+		if ((ext->where != EAIO_WB_DIRTY) && !ext->flushing && !drop) {
+			continue;
+		}
+
+		ext->users++;
+		int ret = eaio_wb_writeout(wb, ext);
+		if ((ret < 0) && !error) {
+			error = ret;
+		}
+		if (drop && !ret && (ext->where != EAIO_WB_FREE)) {
+			eaio_wb_forget(wb, ext, offset, len);
+		}
+		eaio_wb_unpin(wb, ext);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return error;
+}
+
+/*copy a read out of the extents when they hold all of it, -1 otherwise*/
+static int eaio_wb_lookup(struct eaio_wb *wb, const struct eaio_filter_req *req)
+{
+	uint64_t idx = req->offset >> wb->shift;
+	size_t in = req->offset - ((off_t)idx << wb->shift);
+	int ret = -1;
+
+	if (in + req->count > wb->extent) {
+		return -1;
+	}
+	pthread_mutex_lock(&wb->lock);
+	struct eaio_wb_extent *ext = eaio_wb_find(wb, req->fd, idx);
+	if (ext && (in + req->count <= ext->tail)) {
+		int s0 = in >> wb->sshift;
+		int s1 = (in + req->count - 1) >> wb->sshift;
+		int s = s0;
+		while ((s <= s1) && eaio_wb_test(ext->valid, s)) {
+			s++;
+		}
+		if (s > s1) {
+			memcpy(req->buf, ext->data + in, req->count);
+			ret = req->count;
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return ret;
+}
+
+/*
+ * An O_DIRECT write whose last sector reaches past the end of the file: the
+ * extent could only write that sector back short, which O_DIRECT refuses.
+ * Such a write goes down, so the end of the file kept is moved past it here.
+ */
+static bool eaio_wb_direct_tail(struct eaio_wb *wb, const struct eaio_filter_req *req)
+{
+	struct eaio_wb_file *f = &wb->files[req->fd % EAIO_WB_FILES];
+	off_t end = (req->offset + req->count + wb->sector - 1) & ~(off_t)(wb->sector - 1);
+
+	pthread_mutex_lock(&wb->lock);
+	if (f->fd != req->fd) {
+		pthread_mutex_unlock(&wb->lock);
+
+		struct eaio_wb_file look = {
+			.fd = req->fd,
+		};
+		struct stat st;
+		int flags = fcntl(req->fd, F_GETFL);
+		if ((flags >= 0) && (flags & O_DIRECT)) {
+			if (fstat(req->fd, &st) < 0) {
+				return true;
+			}
+			look.direct = !S_ISBLK(st.st_mode);
+			look.size = st.st_size;
+		}
+		pthread_mutex_lock(&wb->lock);
+		*f = look;
+	}
+
+	bool tail = f->direct && (end > f->size);
+	if (tail && (req->offset + (off_t)req->count > f->size)) {
+		f->size = req->offset + req->count;
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return tail;
+}
+
+static int eaio_wb_rdwt(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_wb *wb = container_of(flt, struct eaio_wb, filter);
+	int opt = req->opt & ~EAIO_OPT_BARRIER;
+	int ret;
+
+	if (req->fd < 0) {
+		return eaio_filter_next(flt, req);
+	}
+	if (req->opt & EAIO_OPT_BARRIER) {
+		/*ordered after every write before it, so those must be below already*/
+		ret = eaio_wb_sync(wb, req->fd, 0, 0, false);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+	}
+
+	switch (opt) {
+		case EAIO_OPT_PWRITE:
+		case EAIO_OPT_PWRITEV: {
+			size_t len = eaio_filter_req_len(req);
+			if ((opt == EAIO_OPT_PWRITE) && len && (len <= wb->max_absorb) &&
+				!(req->opt & EAIO_OPT_BARRIER) && !eaio_wb_direct_tail(wb, req)) {
+				ret = eaio_wb_absorb(wb, req, true);
+				if (ret >= 0) {
+					return ret;
+				}
+				/*no room to be had, write it through*/
+			}
+			if (!len) {
+				return eaio_filter_next(flt, req);
+			}
+			ret = eaio_wb_sync(wb, req->fd, req->offset, len, true);
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			eaio_wb_count(&wb->stats.passed, 1);
+			return eaio_filter_next(flt, req);
+		}
+
+		case EAIO_OPT_PREAD:
+			if (!req->count) {
+				return eaio_filter_next(flt, req);
+			}
+			ret = eaio_wb_lookup(wb, req);
+			if (ret >= 0) {
+				eaio_wb_count(&wb->stats.read_hits, 1);
+				return ret;
+			}
+			ret = eaio_wb_sync(wb, req->fd, req->offset, req->count, false);
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			return eaio_filter_next(flt, req);
+
+		case EAIO_OPT_PREADV: {
+			size_t len = eaio_filter_req_len(req);
+			if (len) {
+				ret = eaio_wb_sync(wb, req->fd, req->offset, len, false);
+				if (ret < 0) {
+					errno = -ret;
+					return -1;
+				}
+			}
+			return eaio_filter_next(flt, req);
+		}
+
+		case EAIO_OPT_FSYNC:
+		case EAIO_OPT_FDSYNC:
+			ret = eaio_wb_sync(wb, req->fd, 0, 0, false);
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			return eaio_filter_next(flt, req);
+
+		default:
+			return eaio_filter_next(flt, req);
+	}
+}
+
+/*start an async write-out of the dirty ext, called locked; NULL when no memory*/
+static struct eaio_wb_out *eaio_wb_out_take(struct eaio_wb *wb, struct eaio_wb_extent *ext)
+{
+	struct eaio_wb_out *out = malloc(sizeof(*out));
+
+	if (!out) {
+		return NULL;
+	}
+	ext->users++;
+	out->wb = wb;
+	out->ext = ext;
+	out->since = eaio_wb_take(wb, ext, out->bits);
+	out->tail = ext->tail;
+	out->left = 1;
+	out->error = 0;
+	out->want = 0;
+	out->got = 0;
+	return out;
+}
+
+static void eaio_wb_out_put(struct eaio_wb_out *out)
+{
+	struct eaio_wb *wb = out->wb;
+
+	if (__atomic_sub_fetch(&out->left, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	int error = out->error;
+	if (!error && (out->got != out->want)) {
+		error = EIO;
+	}
+	if (error) {
+		eaio_printf(LOG_ERR, "write-back of fd %d at %llu: %s", out->ext->fd,
+				(unsigned long long)out->ext->idx << wb->shift, strerror(error));
+	}
+	pthread_mutex_lock(&wb->lock);
+	eaio_wb_untake(wb, out->ext, out->bits, out->since, error);
+	eaio_wb_unpin(wb, out->ext);
+	eaio_wb_resume(wb, out->ext, error);
+	pthread_mutex_unlock(&wb->lock);
+	free(out);
+}
+
+static void eaio_wb_out_done(int result, void *usr)
+{
+	struct eaio_wb_out *out = usr;
+
+	if (result < 0) {
+		__atomic_store_n(&out->error, -result, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&out->got, result, __ATOMIC_RELAXED);
+		eaio_wb_count(&out->wb->stats.flushed, result);
+	}
+	eaio_wb_out_put(out);
+}
+
+/*hand the runs of the write-outs down, unlocked*/
+static void eaio_wb_out_start(struct eaio_wb_out *outs)
+{
+	while (outs) {
+		struct eaio_wb_out *out = outs;
+		struct eaio_wb *wb = out->wb;
+		struct eaio_wb_extent *ext = out->ext;
+		struct eaio_filter_req req = {
+			.opt = EAIO_OPT_PWRITE,
+			.qnum = ext->qnum,
+			.prio = wb->prio,
+			.fd = ext->fd,
+			.done = eaio_wb_out_done,
+			.usr = out,
+		};
+		off_t base = (off_t)ext->idx << wb->shift;
+		size_t from, to;
+
+		outs = out->next;
+		for (int s = 0; eaio_wb_run(wb, out->bits, out->tail, &s, &from, &to);) {
+			req.buf = ext->data + from;
+			req.count = to - from;
+			req.offset = base + from;
+			out->want += req.count;
+			__atomic_add_fetch(&out->left, 1, __ATOMIC_RELAXED);
+			eaio_wb_count(&wb->stats.flushes, 1);
+			if (eaio_filter_submit_next(&wb->filter, &req) < 0) {
+				__atomic_store_n(&out->error, errno, __ATOMIC_RELAXED);
+				out->want -= req.count;
+				__atomic_sub_fetch(&out->left, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		eaio_wb_out_put(out);
+	}
+}
+
+/*the async requests of fd wait behind those parked before them*/
+static bool eaio_wb_parked(struct eaio_wb *wb, int fd)
+{
+	for (struct eaio_wb_park *p = wb->parked; p; p = p->next) {
+		if (p->req.fd == fd) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether the async req can go down now, called locked: 1 when nothing it must
+ * come after is held back, 0 when it has to wait for the write-outs, started
+ * here onto outs, of what is, -errno when they cannot be started.
+ */
+static int eaio_wb_clean(struct eaio_wb *wb, const struct eaio_filter_req *req, struct eaio_wb_out **outs)
+{
+	int opt = req->opt & ~EAIO_OPT_BARRIER;
+	bool whole = (req->opt & EAIO_OPT_BARRIER) || (opt == EAIO_OPT_FSYNC) || (opt == EAIO_OPT_FDSYNC);
+	size_t len = 0;
+
+	if ((opt == EAIO_OPT_PWRITE) || (opt == EAIO_OPT_PWRITEV) ||
+		(opt == EAIO_OPT_PREAD) || (opt == EAIO_OPT_PREADV)) {
+		len = eaio_filter_req_len(req);
+	}
+	if (!whole && !len) {
+		return 1;
+	}
+
+	uint64_t first = whole ? 0 : (req->offset >> wb->shift);
+	uint64_t last = whole ? UINT64_MAX : ((req->offset + len - 1) >> wb->shift);
+	bool wait = false;
+	for (int i = 0; i < wb->nextents; i++) {
+		struct eaio_wb_extent *ext = &wb->extents[i];
+		if ((ext->where == EAIO_WB_FREE) || (ext->fd != req->fd) || (ext->idx < first) || (ext->idx > last)) {
+			continue;
+		}
+		if (ext->flushing) {
+			wait = true;
+		} else if (ext->where == EAIO_WB_DIRTY) {
+			struct eaio_wb_out *out = eaio_wb_out_take(wb, ext);
+			if (!out) {
+				return -ENOMEM;
+			}
+			out->next = *outs;
+			*outs = out;
+			wait = true;
+		}
+	}
+	if (wait) {
+		return 0;
+	}
+
+	if (eaio_filter_is_write(req) && len) {
+		first = req->offset >> wb->shift;
+		last = (req->offset + len - 1) >> wb->shift;
+		for (uint64_t idx = first; idx <= last; idx++) {
+			struct eaio_wb_extent *ext = eaio_wb_find(wb, req->fd, idx);
+			if (ext) {
+				eaio_wb_forget(wb, ext, req->offset, len);
+			}
+		}
+	}
+	return 1;
+}
+
+/*hand an async request that was held back down*/
+static int eaio_wb_pass(struct eaio_wb *wb, const struct eaio_filter_req *req)
+{
+	if (eaio_filter_is_write(req)) {
+		eaio_wb_count(&wb->stats.passed, 1);
+	}
+	return eaio_filter_submit_next(&wb->filter, req);
+}
+
+/*
+ * A write-out of ext is over, see which parked requests can go now. Called
+ * locked, returns locked, the lock is dropped to hand them down. Those its
+ * error is for fail with it, rather than write the extent out again and again.
+ */
+static void eaio_wb_resume(struct eaio_wb *wb, const struct eaio_wb_extent *ext, int error)
+{
+	struct eaio_wb_park *p = wb->parked;
+	struct eaio_wb_park *go = NULL;
+	struct eaio_wb_park **gtail = &go;
+	struct eaio_wb_out *outs = NULL;
+
+	if (!p) {
+		return;
+	}
+	wb->parked = NULL;
+	wb->ptail = &wb->parked;
+	while (p) {
+		struct eaio_wb_park *next = p->next;
+		const struct eaio_filter_req *req = &p->req;
+		int ret = 0;
+
+		p->next = NULL;
+		if (error && (req->fd == ext->fd)) {
+			size_t len = eaio_filter_req_len(req);
+			off_t base = (off_t)ext->idx << wb->shift;
+			if ((req->opt & EAIO_OPT_BARRIER) || !len ||
+				((req->offset < base + (off_t)wb->extent) && (req->offset + (off_t)len > base))) {
+				ret = -error;
+			}
+		}
+		if (!ret && !eaio_wb_parked(wb, req->fd)) {
+			ret = eaio_wb_clean(wb, req, &outs);
+		}
+		if (ret) {
+			p->error = (ret < 0) ? -ret : 0;
+			*gtail = p;
+			gtail = &p->next;
+		} else {
+			*wb->ptail = p;
+			wb->ptail = &p->next;
+		}
+		p = next;
+	}
+	if (!go && !outs) {
+		return;
+	}
+
+	pthread_mutex_unlock(&wb->lock);
+	eaio_wb_out_start(outs);
+	while (go) {
+		p = go;
+		go = p->next;
+		if (!p->error && (eaio_wb_pass(wb, &p->req) < 0)) {
+			p->error = errno;
+		}
+		if (p->error) {
+			p->req.done(-p->error, p->req.usr);
+		}
+		free(p);
+	}
+	pthread_mutex_lock(&wb->lock);
+}
+
+/*
+ * The async side: absorbs what it can without waiting, otherwise the extents
+ * the request must come after are written out with async requests and it is
+ * parked until they are done, so the submitter never blocks on them.
+ */
+static int eaio_wb_submit(struct eaio_filter *flt, const struct eaio_filter_req *req)
+{
+	struct eaio_wb *wb = container_of(flt, struct eaio_wb, filter);
+	int opt = req->opt & ~EAIO_OPT_BARRIER;
+	int ret;
+
+	if (req->fd < 0) {
+		return eaio_filter_submit_next(flt, req);
+	}
+	if ((opt == EAIO_OPT_PWRITE) && req->count && (req->count <= wb->max_absorb) &&
+		!(req->opt & EAIO_OPT_BARRIER) && !eaio_wb_direct_tail(wb, req)) {
+		if (eaio_wb_absorb(wb, req, false) >= 0) {
+			req->done(req->count, req->usr);
+			return 0;
+		}
+	}
+	if ((opt == EAIO_OPT_PREAD) && req->count) {
+		ret = eaio_wb_lookup(wb, req);
+		if (ret >= 0) {
+			eaio_wb_count(&wb->stats.read_hits, 1);
+			req->done(ret, req->usr);
+			return 0;
+		}
+	}
+
+	struct eaio_wb_park *p = malloc(sizeof(*p));
+	struct eaio_wb_out *outs = NULL;
+	pthread_mutex_lock(&wb->lock);
+	ret = eaio_wb_parked(wb, req->fd) ? 0 : eaio_wb_clean(wb, req, &outs);
+	if (!ret) {
+		if (p) {
+			p->next = NULL;
+			p->req = *req;
+			/*the caller's tag stays 0, it may be gone by the time this goes down*/
+			p->req.tag = NULL;
+			p->error = 0;
+			*wb->ptail = p;
+			wb->ptail = &p->next;
+			p = NULL;
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+	free(p);
+	eaio_wb_out_start(outs);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret ? eaio_wb_pass(wb, req) : 0;
+}
+
+static int eaio_wb_flush(struct eaio_filter *flt, int fd, off_t offset, size_t len)
+{
+	struct eaio_wb *wb = container_of(flt, struct eaio_wb, filter);
+
+	return eaio_wb_sync(wb, fd, offset, len, false);
+}
+
+/*the file changed behind the filter, what is clean may be stale; len 0 drops all of fd, dirty or not*/
+static void eaio_wb_invalidate(struct eaio_filter *flt, int fd, off_t offset, size_t len)
+{
+	struct eaio_wb *wb = container_of(flt, struct eaio_wb, filter);
+	uint64_t first = len ? (offset >> wb->shift) : 0;
+	uint64_t last = len ? ((offset + len - 1) >> wb->shift) : UINT64_MAX;
+
+	pthread_mutex_lock(&wb->lock);
+	if (!len && (wb->files[fd % EAIO_WB_FILES].fd == fd)) {
+		wb->files[fd % EAIO_WB_FILES].fd = -1;
+	}
+	for (int i = 0; i < wb->nextents; i++) {
+		struct eaio_wb_extent *ext = &wb->extents[i];
+		if ((ext->where == EAIO_WB_FREE) || (ext->fd != fd) || (ext->idx < first) || (ext->idx > last)) {
+			continue;
+		}
+
+		if (!len) {
+			if (ext->ndirty) {
+				eaio_printf(LOG_WARNING, "fd %d: dropping %d dirty sectors at %llu",
+						fd, ext->ndirty, (unsigned long long)ext->idx << wb->shift);
+			}
+			if (!eaio_wb_busy(ext)) {
+				eaio_wb_release(wb, ext);
+				continue;
+			}
+			memset(ext->dirty, 0, sizeof(ext->dirty));
+			ext->ndirty = 0;
+			if (ext->where == EAIO_WB_DIRTY) {
+				list_del(&ext->lnode);
+				list_add_tail(&ext->lnode, &wb->clean);
+				ext->where = EAIO_WB_CLEAN;
+				wb->ndirty--;
+			}
+		}
+		for (int s = 0; s < wb->nsec; s++) {
+			if (!eaio_wb_test(ext->dirty, s)) {
+				eaio_wb_clear(ext->valid, s);
+			}
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+}
+
+static void *eaio_wb_flusher(void *arg)
+{
+	struct eaio_wb *wb = arg;
+	uint64_t period = wb->max_age_ns / 4;
+
+	if (period < 10000000ULL) {
+		period = 10000000ULL;
+	}
+	pthread_mutex_lock(&wb->lock);
+	while (!wb->stop) {
+		uint64_t when = eaio_wb_clock() + period;
+		struct timespec ts = {
+			.tv_sec = when / 1000000000ULL,
+			.tv_nsec = when % 1000000000ULL,
+		};
+		pthread_cond_timedwait(&wb->kick, &wb->lock, &ts);
+
+		uint64_t now = eaio_wb_clock();
+		while (!wb->stop) {
+			struct eaio_wb_extent *pick = NULL;
+			struct eaio_wb_extent *ext;
+			list_for_each_entry(ext, &wb->dirty, lnode) {
+				if (eaio_wb_busy(ext)) {
+					continue;
+				}
+				if ((ext->ndirty == wb->nsec) || (now - ext->since >= wb->max_age_ns) ||
+					(wb->ndirty * 2 > wb->nextents)) {
+					pick = ext;
+					break;
+				}
+			}
+			if (!pick) {
+				break;
+			}
+			pick->users++;
+			int ret = eaio_wb_writeout(wb, pick);
+			eaio_wb_unpin(wb, pick);
+			if (ret < 0) {
+				eaio_printf(LOG_ERR, "write-back of fd %d at %llu: %s", pick->fd,
+						(unsigned long long)pick->idx << wb->shift, strerror(-ret));
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+static const struct eaio_filter_ops eaio_wb_ops = {
+	.name = "writeback",
+	.rdwt = eaio_wb_rdwt,
+	.submit = eaio_wb_submit,
+	.invalidate = eaio_wb_invalidate,
+	.flush = eaio_wb_flush,
+};
+
+struct eaio_wb *eaio_wb_create(struct eaio_context *aio_ctx, const struct eaio_wb_attr *attr)
+{
+	size_t extent = (attr && attr->extent) ? attr->extent : EAIO_WB_EXTENT;
+	size_t sector = (attr && attr->sector) ? attr->sector : EAIO_WB_SECTOR;
+	size_t capacity = (attr && attr->capacity) ? attr->capacity : EAIO_WB_CAPACITY;
+
+	if ((extent & (extent - 1)) || (sector & (sector - 1)) || (sector < sizeof(void *)) ||
+		(sector > extent) || (extent / sector > EAIO_WB_MAX_SECTORS) || (capacity < extent)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	int nextents = capacity / extent;
+	uint64_t nbuckets = 1;
+	while (nbuckets < (uint64_t)nextents) {
+		nbuckets <<= 1;
+	}
+
+	struct eaio_wb *wb = calloc(1, sizeof(*wb));
+	if (!wb) {
+		return NULL;
+	}
+	wb->extents = calloc(nextents, sizeof(struct eaio_wb_extent));
+	wb->hash = calloc(nbuckets, sizeof(struct hlist_head));
+	if (!wb->extents || !wb->hash) {
+		free(wb->extents);
+		free(wb->hash);
+		free(wb);
+		errno = ENOMEM;
+		return NULL;
+	}
+	wb->extent = extent;
+	wb->sector = sector;
+	wb->shift = __builtin_ctzl(extent);
+	wb->sshift = __builtin_ctzl(sector);
+	wb->nsec = extent / sector;
+	wb->max_absorb = (attr && attr->max_absorb) ? attr->max_absorb : EAIO_WB_MAX_ABSORB;
+	wb->max_age_ns = ((attr && (attr->max_age > 0)) ? attr->max_age : EAIO_WB_MAX_AGE) * 1000000ULL;
+	wb->prio = (attr && (attr->prio > 0) && (attr->prio < EAIO_PRIO_MAX)) ? attr->prio : EAIO_PRIO_MAX - 1;
+	wb->hmask = nbuckets - 1;
+	wb->nextents = nextents;
+	INIT_LIST_HEAD(&wb->free);
+	INIT_LIST_HEAD(&wb->clean);
+	INIT_LIST_HEAD(&wb->dirty);
+	wb->ptail = &wb->parked;
+	for (int i = 0; i < EAIO_WB_FILES; i++) {
+		wb->files[i].fd = -1;
+	}
+	for (int i = 0; i < nextents; i++) {
+		wb->extents[i].where = EAIO_WB_FREE;
+		list_add_tail(&wb->extents[i].lnode, &wb->free);
+	}
+
+	pthread_condattr_t cattr;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+	pthread_cond_init(&wb->kick, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	/*below the flusher's first write*/
+	eaio_context_push_filter(aio_ctx, &wb->filter, &eaio_wb_ops);
+	int ret = pthread_create(&wb->flusher, NULL, eaio_wb_flusher, wb);
+	if (ret) {
+		eaio_printf(LOG_ERR, "pthread_create: %s", strerror(ret));
+		eaio_context_remove_filter(aio_ctx, &wb->filter);
+		pthread_cond_destroy(&wb->kick);
+		pthread_cond_destroy(&wb->cond);
+		pthread_mutex_destroy(&wb->lock);
+		free(wb->extents);
+		free(wb->hash);
+		free(wb);
+		errno = ret;
+		return NULL;
+	}
+	return wb;
+}
+
+void eaio_wb_destroy(struct eaio_wb *wb)
+{
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = true;
+	pthread_cond_signal(&wb->kick);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->flusher, NULL);
+
+	/*the layers below must still see it*/
+	int ret = eaio_wb_sync(wb, -1, 0, 0, false);
+	if (ret < 0) {
+		eaio_printf(LOG_ERR, "write-back lost dirty data: %s", strerror(-ret));
+	}
+	eaio_context_remove_filter(wb->filter.aio_ctx, &wb->filter);
+
+	for (int i = 0; i < wb->nextents; i++) {
+		free(wb->extents[i].data);
+	}
+	pthread_cond_destroy(&wb->kick);
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb->extents);
+	free(wb->hash);
+	free(wb);
+}
+
+void eaio_wb_stats(struct eaio_wb *wb, struct eaio_wb_stats *stats)
+{
+	stats->absorbed = __atomic_load_n(&wb->stats.absorbed, __ATOMIC_RELAXED);
+	stats->passed = __atomic_load_n(&wb->stats.passed, __ATOMIC_RELAXED);
+	stats->rmw = __atomic_load_n(&wb->stats.rmw, __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&wb->stats.flushes, __ATOMIC_RELAXED);
+	stats->flushed = __atomic_load_n(&wb->stats.flushed, __ATOMIC_RELAXED);
+	stats->read_hits = __atomic_load_n(&wb->stats.read_hits, __ATOMIC_RELAXED);
+}
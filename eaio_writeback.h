@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eaio_api.h"
+
+struct eaio_wb_attr {
+	size_t extent;	/*bytes buffered per aligned extent, default 1MB*/
+	size_t sector;	/*unit of the bitmaps and of read-modify-write, power of two, default 4096*/
+	size_t capacity;	/*bytes of extent memory, never exceeded, default 64MB*/
+	size_t max_absorb;	/*larger writes go straight down, default 64KB*/
+	int max_age;	/*msec a dirty extent may wait before the flusher writes it, default 1000*/
+	int prio;	/*class of the write-back requests, default EAIO_PRIO_MAX - 1*/
+};
+
+struct eaio_wb_stats {
+	uint64_t absorbed;	/*writes copied into an extent*/
+	uint64_t passed;	/*writes sent straight down*/
+	uint64_t rmw;	/*sectors read in to complete a partial write*/
+	uint64_t flushes;	/*write requests of the write-back*/
+	uint64_t flushed;	/*bytes written back*/
+	uint64_t read_hits;	/*reads served from the extents*/
+};
+
+struct eaio_wb;
+
+/*
+ * Write-back filter on aio_ctx, see eaio_filter.h. EAIO_OPT_PWRITE calls up to
+ * max_absorb bytes are copied into per-(fd, extent) buffers and reported done;
+ * partial sectors are read in first, so every write-back is whole sectors and
+ * fits O_DIRECT. A file may end inside its last sector, so on an O_DIRECT file
+ * a write whose last sector reaches past the end goes straight down, as do the
+ * partial writes on an fd not open for reading. The flags and the end of file
+ * are looked up on an fd's first write and then kept, moved by the writes that
+ * go down past it; eaio_context_invalidate(fd, 0, 0) forgets them, call it
+ * after truncating the file and before its fd number is reused. A flusher thread writes the
+ * dirty sector runs of an extent once it is full, older than max_age, or when
+ * half of the extents are dirty; eaio_flush() and EAIO_OPT_FSYNC do it at once
+ * for one fd. Reads see the buffered data. eaio_context_submit() never waits
+ * on the write-back: a write it cannot absorb without a write-out or a read
+ * goes down, and a request that must follow buffered data is held until async
+ * write-outs of it are done. Write a file through one fd, what two of them hold
+ * of a sector undoes the other's write, and flush an fd before closing it.
+ * Create it after the other filters, so it sits on top and they only see what
+ * it writes back.
+ */
+struct eaio_wb *eaio_wb_create(struct eaio_context *aio_ctx, const struct eaio_wb_attr *attr);
+
+/*after the last request is done and while the queues still run, it flushes everything*/
+void eaio_wb_destroy(struct eaio_wb *wb);
+
+void eaio_wb_stats(struct eaio_wb *wb, struct eaio_wb_stats *stats);
@@ -4,7 +4,11 @@
 #include <errno.h>
 #include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "etask.h"
 #include "eaio_logger.h"
@@ -101,6 +105,80 @@ int eventfd_xwait(int efds[], int nums, int timeout)
 	} while (1);
 }
 
+static pthread_key_t    g_efd_key;
+static pthread_once_t   g_efd_once = PTHREAD_ONCE_INIT;
+static __thread int     t_efd = -1;
+
+static void _efd_local_free(void *arg)
+{
+	/*stored as efd + 1, zero is not passed to destructors*/
+	close((int)(intptr_t)arg - 1);
+}
+
+static void _efd_local_once(void)
+{
+	int ret = pthread_key_create(&g_efd_key, _efd_local_free);
+	assert(ret == 0);
+}
+
+int eventfd_local(void)
+{
+	if (likely(t_efd >= 0)) {
+		return t_efd;
+	}
+
+	pthread_once(&g_efd_once, _efd_local_once);
+
+	int efd = eventfd(0, EFD_CLOEXEC);
+	if (efd < 0) {
+		return -1;
+	}
+	pthread_setspecific(g_efd_key, (void *)(intptr_t)(efd + 1));
+	t_efd = efd;
+	return efd;
+}
+
+// --------------------------------------//
+
+enum
+{
+	EWAIT_IDLE = 0,
+	EWAIT_DONE,
+	EWAIT_SLEEP,
+};
+
+static inline long _futex(int *uaddr, int op, int val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+void ewait_init(struct ewait *ewait)
+{
+	ewait->state = EWAIT_IDLE;
+}
+
+void ewait_wake(struct ewait *ewait)
+{
+	if (__atomic_exchange_n(&ewait->state, EWAIT_DONE, __ATOMIC_RELEASE) == EWAIT_SLEEP) {
+		_futex(&ewait->state, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+void ewait_sleep(struct ewait *ewait)
+{
+	int state = EWAIT_IDLE;
+
+	if (__atomic_compare_exchange_n(&ewait->state, &state, EWAIT_SLEEP,
+		false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		state = EWAIT_SLEEP;
+	}
+
+	while (state != EWAIT_DONE) {
+		_futex(&ewait->state, FUTEX_WAIT_PRIVATE, EWAIT_SLEEP);
+		state = __atomic_load_n(&ewait->state, __ATOMIC_ACQUIRE);
+	}
+}
+
 // --------------------------------------//
 
 struct etask *etask_make(struct etask *etask)
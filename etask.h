@@ -39,6 +39,12 @@ int eventfd_xsend(int efd, eventfd_t value);
 
 int eventfd_xwait(int efds[], int nums, int timeout);
 
+/*
+ * Blocking eventfd owned by the calling thread, created on first use and
+ * closed when the thread exits; callers must drain it before reusing it.
+ */
+int eventfd_local(void);
+
 struct etask
 {
 	int     efd;
@@ -56,3 +62,19 @@ void etask_sleep(struct etask *etask);
 /*msec小于0为无限等待*/
 bool etask_twait(struct etask *etask, int msec);
 
+
+/*
+ * One-shot waiter on a futex, for a single waker and a single sleeper.
+ * ewait_wake() may be called before ewait_sleep(), it never touches the waiter
+ * memory again after the state store except for the futex wakeup itself.
+ */
+struct ewait
+{
+	int     state;
+};
+
+void ewait_init(struct ewait *ewait);
+
+void ewait_wake(struct ewait *ewait);
+
+void ewait_sleep(struct ewait *ewait);
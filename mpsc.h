@@ -0,0 +1,91 @@
+#ifndef __MPSC_H__
+#define __MPSC_H__
+
+/*
+ * Intrusive multi-producer single-consumer queue (D. Vyukov).
+ * Producers never block each other, the consumer never blocks producers.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#if !defined(container_of)
+  #define container_of(ptr, type, member)			    \
+	({							    \
+		const typeof(((type *)0)->member) * __mptr = (ptr); \
+		(type *)((char *)__mptr - offsetof(type, member));  \
+	})
+#endif
+
+struct mpsc_node
+{
+	struct mpsc_node        *next;
+};
+
+struct mpsc_queue
+{
+	struct mpsc_node        *head;	/* producers side */
+	struct mpsc_node        *tail;	/* consumer side */
+	struct mpsc_node        stub;
+};
+
+static inline void INIT_MPSC_QUEUE(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	struct mpsc_node *prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return NULL when empty, or when a producer is between its exchange and its
+ * link; that producer signals the consumer afterwards, so it is seen next time.
+ */
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node        *tail = q->tail;
+	struct mpsc_node        *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next) {
+			return NULL;
+		}
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	mpsc_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static inline bool mpsc_empty(struct mpsc_queue *q)
+{
+	return (q->tail == &q->stub) && !__atomic_load_n(&q->stub.next, __ATOMIC_ACQUIRE);
+}
+
+#define mpsc_entry(ptr, type, member) \
+	container_of(ptr, type, member)
+
+#endif	/* ifndef __MPSC_H__ */
@@ -17,6 +17,15 @@
 
 #include "array.h"
 #include "eaio_api.h"
+#include "eaio_bufpool.h"
+#include "eaio_cache.h"
+#include "eaio_copy.h"
+#include "eaio_coro.h"
+#include "eaio_numa.h"
+#include "eaio_readahead.h"
+#include "eaio_stats.h"
+#include "eaio_writeback.h"
+#include "etask.h"
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -30,20 +39,6 @@
   #define unlikely(x)   (!!(x))
 #endif
 
-void *xvalloc(size_t size)
-{
-        void    *ret = NULL;
-        int     err = posix_memalign((void **)&ret, getpagesize(), size);
-
-        if (unlikely(err)) {
-                assert(0);
-        }
-
-        memset(ret, 0, size);
-        return ret;
-}
-
-
 static ssize_t _pread(int fd, void *buf, size_t len, off_t offset)
 {
 	ssize_t nr;
@@ -173,6 +168,37 @@ bool opt_direct = false;
 int opt_thread = 1;
 char *opt_if = NULL;
 char *opt_of = NULL;
+enum eaio_engine opt_engine = EAIO_ENGINE_LIBAIO;
+int opt_executor = 0;
+int opt_depth = 0;
+int opt_target_lat = 0;
+bool opt_merge = false;
+bool opt_hugepage = false;
+bool opt_stats = false;
+char *opt_trace = NULL;
+int opt_cpus[64];
+int opt_ncpus = 0;
+bool opt_sync = false;
+int opt_nbufs = 4;
+int opt_spin = 0;
+int opt_coro = 0;
+bool opt_numa = false;
+bool opt_readahead = false;
+uint64_t opt_cache = 0;
+uint64_t opt_writeback = 0;
+/*benchmark mode*/
+bool opt_bench = false;
+char *opt_file = NULL;
+int opt_rwmix = 100;
+int opt_iodepth = 1;
+int opt_runtime = 10;
+uint64_t opt_size = 0;
+#define BSDIST_MAX 16
+struct bsdist {
+	uint64_t bs;
+	int weight;
+} opt_bsdist[BSDIST_MAX];
+int opt_nbsdist = 0;
 
 static struct option longopts[] = {
 	{ "help", no_argument,       NULL, 'h' },
@@ -188,6 +214,29 @@ static struct option longopts[] = {
 	{ "obs", required_argument, NULL, 'O' },
 	{ "skip", required_argument, NULL, 'p' },
 	{ "seek", required_argument, NULL, 'k' },
+	{ "engine", required_argument, NULL, 'e' },
+	{ "executor", required_argument, NULL, 'x' },
+	{ "cpus", required_argument, NULL, 'C' },
+	{ "depth", required_argument, NULL, 'q' },
+	{ "target-lat", required_argument, NULL, 'L' },
+	{ "merge", no_argument, NULL, 'm' },
+	{ "hugepage", no_argument, NULL, 'H' },
+	{ "stats", no_argument, NULL, 'S' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "nbufs", required_argument, NULL, 'n' },
+	{ "spin", required_argument, NULL, 'P' },
+	{ "coro", required_argument, NULL, 'K' },
+	{ "numa", no_argument, NULL, 'N' },
+	{ "readahead", no_argument, NULL, 'A' },
+	{ "cache", required_argument, NULL, 'Y' },
+	{ "writeback", required_argument, NULL, 'W' },
+	{ "bench", no_argument, NULL, 'B' },
+	{ "file", required_argument, NULL, 'f' },
+	{ "rwmix", required_argument, NULL, 'M' },
+	{ "iodepth", required_argument, NULL, 'D' },
+	{ "bsdist", required_argument, NULL, 'z' },
+	{ "runtime", required_argument, NULL, 'R' },
+	{ "size", required_argument, NULL, 's' },
 	{ NULL,   0,                 NULL, 0   }
 };
 
@@ -206,14 +255,39 @@ static void usage(const char *execfile)
 	printf("  -O, --obs=size              set obs size, default is 4k\n");
 	printf("  -p, --skip=num              set ibs op count, default is 0\n");
 	printf("  -k, --seek=num              set obs op count, default is 0\n");
+	printf("  -e, --engine=name           set engine, sync, libaio or uring, default is libaio\n");
+	printf("  -x, --executor=num          set executor threads, default is 0 (one eaio_context_exec loop)\n");
+	printf("  -C, --cpus=list             pin executor threads to cpus, like 0,2,4\n");
+	printf("  -q, --depth=num             set queue depth, default is 512\n");
+	printf("  -L, --target-lat=usec       adapt queue depth to this completion latency\n");
+	printf("  -m, --merge                 merge adjacent requests into one vectored io\n");
+	printf("  -K, --coro=num              run the -t copies as coroutines on num threads, with -a\n");
+	printf("  -P, --spin=usec             poll for completions this long before sleeping, reaping the libaio ring directly\n");
+	printf("  -H, --hugepage              back the io buffers with 2MB pages\n");
+	printf("  -N, --numa                  bind the queues to the NUMA nodes in turn, the bench buffers to the device's\n");
+	printf("  -S, --stats                 print queue statistics and latency percentiles at the end\n");
+	printf("  -n, --nbufs=num             buffers in flight per thread for the async sequential copy, default is 4\n");
+	printf("  -T, --trace=file            dump the request lifecycle of every queue to file, as json if it ends with .json\n");
+	printf("  -A, --readahead             prefetch ahead of sequential and strided reads, print its hits at the end\n");
+	printf("  -Y, --cache=size            keep read blocks in a cache of size, print its hits at the end\n");
+	printf("  -W, --writeback=size        hold small writes in size of buffers, print what it wrote back at the end\n");
 	printf("  -h, --help                  show this message\n\n");
+	printf("Benchmark mode, results are printed as json:\n");
+	printf("  -B, --bench                 run a timed workload on --file instead of copying\n");
+	printf("  -f, --file=file             the file or block device to test, written to unless rwmix is 100\n");
+	printf("  -M, --rwmix=pct             percentage of reads, default is 100\n");
+	printf("  -D, --iodepth=num           requests kept in flight by each thread, default is 1\n");
+	printf("  -z, --bsdist=list           block sizes with weights, like 4k:70,64k:30, default is bs\n");
+	printf("  -R, --runtime=sec           run time, default is 10\n");
+	printf("  -s, --size=size             bytes of the file to use, default is its size\n");
+	printf("  -t, -r, -d, -e, -x, -q, -P  as above\n\n");
 }
 
 int parse(int argc, char *argv[])
 {
 	int             c;
 
-	while ((c = getopt_long(argc, argv, "ab:di:o:r:t:c:I:O:p:k:h", longopts, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "ab:di:o:rt:c:I:O:p:k:e:x:C:q:L:mHNST:n:P:K:AY:W:Bf:M:D:z:R:s:h", longopts, NULL)) != EOF) {
 		switch (c) {
 			case 'a':
 				opt_async = true;
@@ -263,15 +337,151 @@ int parse(int argc, char *argv[])
 				opt_seek = atoi(optarg);
 				break;
 
+			case 'e':
+				if (strcmp(optarg, "libaio") == 0) {
+					opt_engine = EAIO_ENGINE_LIBAIO;
+				} else if (strcmp(optarg, "uring") == 0) {
+					opt_engine = EAIO_ENGINE_URING;
+				} else if (strcmp(optarg, "sync") == 0) {
+					opt_sync = true;
+				} else {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'x':
+				opt_executor = atoi(optarg);
+				break;
+
+			case 'q':
+				opt_depth = atoi(optarg);
+				break;
+
+			case 'L':
+				opt_target_lat = atoi(optarg);
+				break;
+
+			case 'm':
+				opt_merge = true;
+				break;
+
+			case 'H':
+				opt_hugepage = true;
+				break;
+
+			case 'N':
+				opt_numa = true;
+				break;
+
+			case 'S':
+				opt_stats = true;
+				break;
+
+			case 'T':
+				opt_trace = optarg;
+				break;
+
+			case 'A':
+				opt_readahead = true;
+				break;
+
+			case 'Y':
+				option_parse_size(optarg, &opt_cache);
+				break;
+
+			case 'W':
+				option_parse_size(optarg, &opt_writeback);
+				break;
+
+			case 'n':
+				opt_nbufs = atoi(optarg);
+				if (opt_nbufs < 1) {
+					opt_nbufs = 1;
+				}
+				break;
+
+			case 'P':
+				opt_spin = atoi(optarg);
+				break;
+
+			case 'K':
+				opt_coro = atoi(optarg);
+				break;
+
+			case 'B':
+				opt_bench = true;
+				break;
+
+			case 'f':
+				opt_file = optarg;
+				break;
+
+			case 'M':
+				opt_rwmix = atoi(optarg);
+				if ((opt_rwmix < 0) || (opt_rwmix > 100)) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
+			case 'D':
+				opt_iodepth = atoi(optarg);
+				break;
+
+			case 'z':
+				for (char *item = strtok(optarg, ","); item && (opt_nbsdist < BSDIST_MAX); item = strtok(NULL, ",")) {
+					char *weight = strchr(item, ':');
+					if (weight) {
+						*weight++ = '\0';
+					}
+					struct bsdist *dist = &opt_bsdist[opt_nbsdist++];
+					if ((option_parse_size(item, &dist->bs) < 0) || !dist->bs) {
+						usage(argv[0]);
+						return 1;
+					}
+					dist->weight = weight ? atoi(weight) : 1;
+				}
+				break;
+
+			case 'R':
+				opt_runtime = atoi(optarg);
+				break;
+
+			case 's':
+				option_parse_size(optarg, &opt_size);
+				break;
+
+			case 'C':
+				for (char *cpu = strtok(optarg, ","); cpu && (opt_ncpus < 64); cpu = strtok(NULL, ",")) {
+					opt_cpus[opt_ncpus++] = atoi(cpu);
+				}
+				break;
+
 			default:
 				usage(argv[0]);
 				return 1;
 		}
 	}
-	if (!opt_if || !opt_of) {
+	if (opt_bench ? !opt_file : (!opt_if || !opt_of)) {
 		usage(argv[0]);
 		return -1;
 	}
+	if (opt_iodepth < 1) {
+		opt_iodepth = 1;
+	}
+	if (!opt_nbsdist) {
+		opt_bsdist[0].bs = opt_bs;
+		opt_bsdist[0].weight = 1;
+		opt_nbsdist = 1;
+	}
+	if (opt_sync) {
+		opt_async = false;
+	}
+	if ((opt_readahead || opt_cache || opt_writeback) && (opt_bench ? opt_sync : !opt_async)) {
+		fprintf(stderr, "test: -A, -Y and -W need the async engines, with -a unless -B.\n");
+		return -1;
+	}
 	return 0;
 }
 /****************************************************************/
@@ -309,7 +519,10 @@ int _do_rw(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
 {
 	int ret = 0;
 
-	if (opt_async) {
+	if (opt_async && opt_coro) {
+		ret = eaio_coro_rdwt(aio_ctx, opt, qnum, prio,
+				fd, buf, count, offset);
+	} else if (opt_async) {
 		ret = eaio_context_rdwt(aio_ctx, opt, qnum, prio,
 				fd, buf, count, offset,
 				NULL, NULL);
@@ -325,15 +538,35 @@ int _do_rw(struct eaio_context *aio_ctx, enum eaio_opt opt, int qnum, int prio,
 }
 
 
+/*the filters know files by fd, and close() hands the number out again*/
+void _do_close(struct eaio_context *aio_ctx, int fd)
+{
+	if (aio_ctx->filters) {
+		eaio_flush(aio_ctx, fd);
+		eaio_context_invalidate(aio_ctx, fd, 0, 0);
+	}
+	close(fd);
+}
+
+
 off_t g_data_size = 0;
 struct eaio_context *g_ctx = NULL;
+struct eaio_bufpool *g_pool = NULL;
+/*
+ * With filters the threads share one fd for the output, what the write-back
+ * holds of a sector through one fd would undo a write to it through another.
+ * Each thread keeps its own input fd, read-ahead follows one stream per fd.
+ */
+int g_wfd = -1;
+int g_flt_flags = 0;	/*of those fds*/
 
 static inline bool is_aligned_to_pagesize(void *p)
 {
 	return ((uintptr_t)p & (getpagesize() - 1)) == 0;
 }
 
-int do_test_rw(void *data, off_t offset, size_t length)
+/*rfd is the thread's input fd, -1 to open one for this block*/
+int do_test_rw(void *data, off_t offset, size_t length, int rfd)
 {
 	struct eaio_context *ctx = g_ctx;
 	uint64_t if_skip_offset = opt_ibs * opt_skip;
@@ -349,30 +582,52 @@ int do_test_rw(void *data, off_t offset, size_t length)
 		}
 	}
 
-	int rfd = open(opt_if, O_RDONLY | flags);
-	if (rfd < 0) {
-		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_if, strerror(errno));
-		return -1;
+	bool own = (rfd < 0);
+	if (own) {
+		rfd = open(opt_if, O_RDONLY | flags);
+		if (rfd < 0) {
+			fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_if, strerror(errno));
+			return -1;
+		}
 	}
 	int ret = _do_rw(ctx, EAIO_OPT_PREAD, 0, 0, rfd, data, length, if_skip_offset + offset);
 	assert(ret == length);
-	close(rfd);
+	if (own) {
+		_do_close(ctx, rfd);
+	}
 
-	int wfd = open(opt_of, O_WRONLY | flags, _def_fmode);
+	int wfd = (g_wfd >= 0) ? g_wfd : open(opt_of, O_WRONLY | flags, _def_fmode);
 	if (wfd < 0) {
 		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_of, strerror(errno));
 		return -1;
 	}
 	ret = _do_rw(ctx, EAIO_OPT_PWRITE, 1, 0, wfd, data, length, of_seek_offset + offset);
 	assert(ret == length);
-	close(wfd);
+	if (wfd != g_wfd) {
+		_do_close(ctx, wfd);
+	}
 	return 0;
 }
 
+/*the thread's input fd when the filters want one, else -1*/
+static int test_reader(void)
+{
+	if (g_wfd < 0) {
+		return -1;
+	}
+	int rfd = open(opt_if, O_RDONLY | g_flt_flags);
+	if (rfd < 0) {
+		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_if, strerror(errno));
+	}
+	return rfd;
+}
+
 void do_test_sequ(long idx)
 {
+	int rfd = test_reader();
 	int i = 0;
-	char *data = xvalloc(opt_bs);
+	char *data = eaio_bufpool_alloc(g_pool, opt_bs);
+	assert(data);
 	do {
 		off_t offset = (i * opt_thread + idx) * opt_bs;
 		if (offset >= g_data_size) {
@@ -380,9 +635,53 @@ void do_test_sequ(long idx)
 		}
 		size_t length = ((offset + opt_bs) > g_data_size) ? (g_data_size - offset) : opt_bs;
 
-		do_test_rw(data, offset, length);
+		do_test_rw(data, offset, length, rfd);
 	} while (++i);
-	free(data);
+	eaio_bufpool_free(g_pool, data);
+	if (rfd >= 0) {
+		_do_close(g_ctx, rfd);
+	}
+}
+
+/*async sequential: each thread copies one contiguous share through eaio_copy_range()*/
+void do_test_copy(long idx)
+{
+	uint64_t share = roundup((g_data_size + opt_thread - 1) / opt_thread, opt_bs);
+	off_t offset = idx * share;
+	if (offset >= g_data_size) {
+		return;
+	}
+	uint64_t length = MIN(share, g_data_size - offset);
+	int flags = (opt_direct && sector_algined(length)) ? O_DIRECT : 0;
+
+	/*its own, read-ahead follows one stream per fd*/
+	int rfd = open(opt_if, O_RDONLY | flags);
+	if (rfd < 0) {
+		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_if, strerror(errno));
+		return;
+	}
+	int wfd = (g_wfd >= 0) ? g_wfd : open(opt_of, O_WRONLY | flags);
+	if (wfd < 0) {
+		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_of, strerror(errno));
+		_do_close(g_ctx, rfd);
+		return;
+	}
+
+	struct eaio_copy_attr cattr = {
+		.bs = opt_bs,
+		.nbufs = opt_nbufs,
+		.pool = g_pool,
+	};
+	ssize_t ret = eaio_copy_range(g_ctx, 0, rfd, opt_ibs * opt_skip + offset,
+			1, wfd, opt_obs * opt_seek + offset, length, &cattr);
+	if (ret != (ssize_t)length) {
+		fprintf(stderr, "test: Copy of %lu bytes at %ld failed: %s.\n", length, offset,
+			(ret < 0) ? strerror(-ret) : "short read");
+	}
+	_do_close(g_ctx, rfd);
+	if (wfd != g_wfd) {
+		_do_close(g_ctx, wfd);
+	}
 }
 
 void do_test_rand(long idx)
@@ -399,15 +698,20 @@ void do_test_rand(long idx)
 	}
 	xshuffle(map, n, sizeof(uint64_t));
 
-	char *data = xvalloc(opt_bs);
+	int rfd = test_reader();
+	char *data = eaio_bufpool_alloc(g_pool, opt_bs);
+	assert(data);
 	for (uint64_t i = 0; i < n; i ++) {
 		off_t offset = map[i] * opt_bs;
 		assert(offset < g_data_size);
 		size_t length = ((offset + opt_bs) > g_data_size) ? (g_data_size - offset) : opt_bs;
 
-		do_test_rw(data, offset, length);
+		do_test_rw(data, offset, length, rfd);
+	}
+	eaio_bufpool_free(g_pool, data);
+	if (rfd >= 0) {
+		_do_close(g_ctx, rfd);
 	}
-	free(data);
 
 	free(map);
 }
@@ -419,6 +723,9 @@ void *do_test(void *arg)
 	if (opt_random) {
 		/*模拟随机读写*/
 		do_test_rand(idx);
+	} else if (opt_async && !opt_coro) {
+		/*eaio_copy_range() sleeps its thread, not for coroutines*/
+		do_test_copy(idx);
 	} else {
 		/*模拟顺序读写*/
 		do_test_sequ(idx);
@@ -426,6 +733,11 @@ void *do_test(void *arg)
 	return NULL;
 }
 
+static void do_test_coro(void *arg)
+{
+	do_test(arg);
+}
+
 int go_test(struct eaio_context *aio_ctx)
 {
 	g_ctx = aio_ctx;
@@ -478,17 +790,375 @@ int go_test(struct eaio_context *aio_ctx)
 	}
 	close(wfd);
 
+	if (aio_ctx->filters) {
+		g_flt_flags = (opt_direct && sector_algined(opt_bs) && sector_algined(g_data_size)) ? O_DIRECT : 0;
+		/*readable too, the write-back reads in the rest of a sector written in part*/
+		g_wfd = open(opt_of, O_RDWR | g_flt_flags);
+		if (g_wfd < 0) {
+			fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_of, strerror(errno));
+			return -1;
+		}
+	}
 
-	pthread_t tid[opt_thread];
-	for (long i = 0; i < opt_thread; i++) {
-		int ret = pthread_create(&tid[i], NULL, do_test, (void *)i);
-		assert(ret == 0);
+	struct eaio_bufpool_attr pattr = {
+		.max_size = opt_bs,
+		.nbufs = opt_thread * opt_nbufs,
+		.hugepage = opt_hugepage,
+	};
+	g_pool = eaio_bufpool_create(&pattr);
+	if (!g_pool) {
+		fprintf(stderr, "test: Unable to create the buffer pool: %s.\n", strerror(errno));
+		return -1;
 	}
 
-	for (int i = 0; i < opt_thread; i++) {
-		pthread_join(tid[i], NULL);
+	if (opt_async && opt_coro) {
+		struct eaio_coro_attr cattr = {
+			.nthreads = opt_coro,
+		};
+		struct eaio_coro_sched *sched = eaio_coro_sched_create(&cattr);
+		if (!sched) {
+			fprintf(stderr, "test: Unable to start the coroutine threads.\n");
+			eaio_bufpool_destroy(g_pool);
+			g_pool = NULL;
+			return -1;
+		}
+		for (long i = 0; i < opt_thread; i++) {
+			int ret = eaio_coro_spawn(sched, do_test_coro, (void *)i);
+			assert(ret == 0);
+		}
+		eaio_coro_sched_wait(sched);
+		eaio_coro_sched_destroy(sched);
+	} else {
+		pthread_t tid[opt_thread];
+		for (long i = 0; i < opt_thread; i++) {
+			int ret = pthread_create(&tid[i], NULL, do_test, (void *)i);
+			assert(ret == 0);
+		}
+
+		for (int i = 0; i < opt_thread; i++) {
+			pthread_join(tid[i], NULL);
+		}
 	}
 
+	eaio_bufpool_destroy(g_pool);
+	g_pool = NULL;
+	if (g_wfd >= 0) {
+		_do_close(aio_ctx, g_wfd);
+		g_wfd = -1;
+	}
+	return 0;
+}
+
+/****************************************************************/
+/*benchmark mode: every thread keeps iodepth requests in flight until the runtime is over*/
+struct bench_job;
+
+struct bench_io {
+	struct bench_job *job;
+	char *buf;
+	bool write;
+	size_t bs;
+	uint64_t stamp;
+};
+
+struct bench_side {
+	uint64_t ios;
+	uint64_t bytes;
+	uint64_t errors;
+	struct eaio_hist lat;
+};
+
+struct bench_job {
+	long idx;
+	int qnum;
+	unsigned seed;
+	uint64_t start;	/*region of the file used by this thread*/
+	uint64_t span;
+	uint64_t cursor;	/*next offset when sequential*/
+	int inflight;
+	struct etask done;
+	struct bench_io *ios;
+	struct bench_side side[2];	/*read, write*/
+};
+
+int g_bench_fd = -1;
+bool g_bench_stop = false;
+
+static uint64_t clock_get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bsdist_max(void)
+{
+	uint64_t max = 0;
+	for (int i = 0; i < opt_nbsdist; i++) {
+		max = MAX(max, opt_bsdist[i].bs);
+	}
+	return max;
+}
+
+static uint64_t bsdist_pick(unsigned *seed)
+{
+	int total = 0;
+	for (int i = 0; i < opt_nbsdist; i++) {
+		total += opt_bsdist[i].weight;
+	}
+	int pick = total ? (rand_r(seed) % total) : 0;
+	for (int i = 0; i < opt_nbsdist; i++) {
+		pick -= opt_bsdist[i].weight;
+		if (pick < 0) {
+			return opt_bsdist[i].bs;
+		}
+	}
+	return opt_bsdist[0].bs;
+}
+
+/*called by the thread itself before the first submit, then only from the done callback*/
+static off_t bench_prep(struct bench_job *job, struct bench_io *io)
+{
+	off_t offset;
+
+	io->write = (rand_r(&job->seed) % 100) >= opt_rwmix;
+	io->bs = bsdist_pick(&job->seed);
+	if (opt_random) {
+		uint64_t blocks = job->span / io->bs;
+		uint64_t r = ((uint64_t)rand_r(&job->seed) << 31) | rand_r(&job->seed);
+		offset = job->start + (r % blocks) * io->bs;
+	} else {
+		if (job->cursor + io->bs > job->start + job->span) {
+			job->cursor = job->start;
+		}
+		offset = job->cursor;
+		job->cursor += io->bs;
+	}
+	return offset;
+}
+
+static void bench_account(struct bench_job *job, bool write, int result, uint64_t lat)
+{
+	struct bench_side *side = &job->side[write];
+
+	if (result < 0) {
+		side->errors++;
+		return;
+	}
+	side->ios++;
+	side->bytes += result;
+	eaio_hist_add(&side->lat, lat);
+}
+
+static void bench_done(int result, void *usr);
+
+static int bench_submit(struct bench_io *io, off_t offset)
+{
+	struct bench_job *job = io->job;
+
+	io->stamp = clock_get_nsec();
+	return eaio_context_submit(g_ctx, io->write ? EAIO_OPT_PWRITE : EAIO_OPT_PREAD, job->qnum, 0,
+			g_bench_fd, io->buf, io->bs, offset, bench_done, io);
+}
+
+static void bench_done(int result, void *usr)
+{
+	struct bench_io *io = usr;
+	struct bench_job *job = io->job;
+
+	bench_account(job, io->write, result, clock_get_nsec() - io->stamp);
+	if (!__atomic_load_n(&g_bench_stop, __ATOMIC_RELAXED)) {
+		off_t offset = bench_prep(job, io);
+		if (bench_submit(io, offset) == 0) {
+			return;
+		}
+	}
+	if (__atomic_sub_fetch(&job->inflight, 1, __ATOMIC_ACQ_REL) == 0) {
+		etask_awake(&job->done);
+	}
+}
+
+static void bench_sync(struct bench_job *job)
+{
+	struct bench_io *io = &job->ios[0];
+
+	while (!__atomic_load_n(&g_bench_stop, __ATOMIC_RELAXED)) {
+		off_t offset = bench_prep(job, io);
+		uint64_t stamp = clock_get_nsec();
+		ssize_t ret = io->write ? pwrite(g_bench_fd, io->buf, io->bs, offset) :
+					  pread(g_bench_fd, io->buf, io->bs, offset);
+		bench_account(job, io->write, (ret < 0) ? -errno : ret, clock_get_nsec() - stamp);
+	}
+}
+
+void *bench_thread(void *arg)
+{
+	struct bench_job *job = arg;
+
+	if (opt_sync) {
+		bench_sync(job);
+		return NULL;
+	}
+
+	/*prepare everything first, the callbacks own seed and cursor once the first io is out*/
+	off_t offsets[opt_iodepth];
+	for (int i = 0; i < opt_iodepth; i++) {
+		offsets[i] = bench_prep(job, &job->ios[i]);
+	}
+	job->inflight = opt_iodepth;
+	for (int i = 0; i < opt_iodepth; i++) {
+		if (bench_submit(&job->ios[i], offsets[i]) < 0) {
+			if (__atomic_sub_fetch(&job->inflight, 1, __ATOMIC_ACQ_REL) == 0) {
+				etask_awake(&job->done);
+			}
+		}
+	}
+	etask_sleep(&job->done);
+	return NULL;
+}
+
+static void bench_print_side(const char *name, struct bench_side *side, uint64_t elapsed, bool last)
+{
+	double sec = elapsed / 1e9;
+
+	printf("  \"%s\": {\"ios\": %lu, \"bytes\": %lu, \"errors\": %lu, \"iops\": %.1f, \"bw_bytes\": %.0f,\n",
+		name, side->ios, side->bytes, side->errors, side->ios / sec, side->bytes / sec);
+	printf("    \"lat_ns\": {\"mean\": %.0f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}%s\n",
+		side->lat.count ? (double)side->lat.sum / side->lat.count : 0.0,
+		eaio_hist_percentile(&side->lat, 50), eaio_hist_percentile(&side->lat, 90),
+		eaio_hist_percentile(&side->lat, 99), eaio_hist_percentile(&side->lat, 99.9),
+		side->lat.max, last ? "" : ",");
+}
+
+int go_bench(struct eaio_context *aio_ctx)
+{
+	g_ctx = aio_ctx;
+
+	bool readonly = (opt_rwmix == 100);
+	int flags = (readonly ? O_RDONLY : (O_RDWR | O_CREAT)) | (opt_direct ? O_DIRECT : 0);
+	g_bench_fd = open(opt_file, flags, _def_fmode);
+	if (g_bench_fd < 0) {
+		fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_file, strerror(errno));
+		return -1;
+	}
+
+	struct stat stat_buf;
+	uint64_t size = 0;
+	if (fstat(g_bench_fd, &stat_buf) < 0) {
+		fprintf(stderr, "test: Unable to get file \"%s\" type: %s.\n", opt_file, strerror(errno));
+		close(g_bench_fd);
+		return -1;
+	}
+	if (S_ISBLK(stat_buf.st_mode)) {
+		ioctl(g_bench_fd, BLKGETSIZE64, &size);
+	} else {
+		size = stat_buf.st_size;
+	}
+	if (opt_size) {
+		if ((opt_size > size) && (readonly || S_ISBLK(stat_buf.st_mode) || (ftruncate(g_bench_fd, opt_size) < 0))) {
+			fprintf(stderr, "test: \"%s\" is smaller than %ld.\n", opt_file, opt_size);
+			close(g_bench_fd);
+			return -1;
+		}
+		size = opt_size;
+	}
+
+	int njobs = opt_thread;
+	uint64_t max_bs = bsdist_max();
+	uint64_t slice = opt_random ? size : (size / njobs);
+	if (slice < max_bs) {
+		fprintf(stderr, "test: \"%s\" is too small for %d threads of %ld bytes.\n", opt_file, njobs, max_bs);
+		close(g_bench_fd);
+		return -1;
+	}
+
+	int node = opt_numa ? eaio_numa_fd_node(g_bench_fd) : -1;
+	struct eaio_bufpool_attr pattr = {
+		.max_size = max_bs,
+		.nbufs = njobs * opt_iodepth,
+		.hugepage = opt_hugepage,
+		.numa = (node >= 0),
+		.node = node,
+	};
+	g_pool = eaio_bufpool_create(&pattr);
+	assert(g_pool);
+
+	/*with -N the jobs take turns on the queues bound to the device's node, if any*/
+	int bound[aio_ctx->qcnts];
+	int nbound = 0;
+	for (int q = 0; (node >= 0) && (q < aio_ctx->qcnts); q++) {
+		if (aio_ctx->qslot[q].node == node) {
+			bound[nbound++] = q;
+		}
+	}
+
+	struct bench_job *jobs = calloc(njobs, sizeof(*jobs));
+	assert(jobs);
+	for (long i = 0; i < njobs; i++) {
+		struct bench_job *job = &jobs[i];
+
+		job->idx = i;
+		job->qnum = nbound ? bound[i % nbound] : (i % aio_ctx->qcnts);
+		job->seed = (unsigned)(clock_get_nsec() + i);
+		job->start = opt_random ? 0 : (i * slice);
+		job->span = slice;
+		job->cursor = job->start;
+		etask_make(&job->done);
+		job->ios = calloc(opt_iodepth, sizeof(struct bench_io));
+		assert(job->ios);
+		for (int j = 0; j < opt_iodepth; j++) {
+			job->ios[j].job = job;
+			job->ios[j].buf = eaio_bufpool_alloc(g_pool, max_bs);
+			assert(job->ios[j].buf);
+			memset(job->ios[j].buf, 0x5a, max_bs);
+		}
+	}
+
+	uint64_t beg = clock_get_nsec();
+	pthread_t tid[njobs];
+	for (int i = 0; i < njobs; i++) {
+		int ret = pthread_create(&tid[i], NULL, bench_thread, &jobs[i]);
+		assert(ret == 0);
+	}
+	sleep(opt_runtime);
+	__atomic_store_n(&g_bench_stop, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < njobs; i++) {
+		pthread_join(tid[i], NULL);
+	}
+	uint64_t elapsed = clock_get_nsec() - beg;
+
+	struct bench_side total[2];
+	memset(total, 0, sizeof(total));
+	for (int i = 0; i < njobs; i++) {
+		struct bench_job *job = &jobs[i];
+
+		for (int rw = 0; rw < 2; rw++) {
+			total[rw].ios += job->side[rw].ios;
+			total[rw].bytes += job->side[rw].bytes;
+			total[rw].errors += job->side[rw].errors;
+			eaio_hist_merge(&total[rw].lat, &job->side[rw].lat);
+		}
+		for (int j = 0; j < opt_iodepth; j++) {
+			eaio_bufpool_free(g_pool, job->ios[j].buf);
+		}
+		free(job->ios);
+		etask_free(&job->done);
+	}
+	free(jobs);
+	eaio_bufpool_destroy(g_pool);
+	g_pool = NULL;
+	_do_close(aio_ctx, g_bench_fd);
+
+	static const char *engines[] = { "libaio", "uring" };
+	printf("{\n");
+	printf("  \"engine\": \"%s\", \"threads\": %d, \"iodepth\": %d, \"rwmix_read\": %d, \"random\": %s, "
+		"\"direct\": %s, \"size\": %lu, \"runtime_ns\": %lu,\n",
+		opt_sync ? "sync" : engines[opt_engine], njobs, opt_iodepth, opt_rwmix,
+		opt_random ? "true" : "false", opt_direct ? "true" : "false", size, elapsed);
+	bench_print_side("read", &total[0], elapsed, false);
+	bench_print_side("write", &total[1], elapsed, true);
+	printf("}\n");
 	return 0;
 }
 
@@ -527,24 +1197,148 @@ int main(int argc, char *argv[])
 
 	/*start*/
 	struct eaio_context ctx = {0};
-	ret = eaio_context_init(&ctx, 2);
+	struct eaio_qattr qattr[2] = {
+		{ .depth = opt_depth, .target_lat = opt_target_lat, .merge = opt_merge },
+		{ .depth = opt_depth, .target_lat = opt_target_lat, .merge = opt_merge },
+	};
+	if (opt_trace) {
+		qattr[0].trace_size = qattr[1].trace_size = (1 << 16);
+	}
+	if (opt_numa) {
+		int nodes = eaio_numa_nodes();
+		for (int i = 0; i < 2; i++) {
+			qattr[i].numa = true;
+			qattr[i].node = i % nodes;
+		}
+	}
+	struct eaio_attr attr = {
+		.engine = opt_engine,
+		.qattr = qattr,
+		.spin_us = opt_spin,
+	};
+	ret = eaio_context_init_attr(&ctx, 2, &attr);
 	assert(ret == 0);
 
 	pthread_t tid;
-	ret = pthread_create(&tid, NULL, aio_manager, &ctx);
+	if (opt_executor > 0) {
+		for (int i = opt_ncpus; i < opt_executor && i < 64; i++) {
+			opt_cpus[i] = -1;
+		}
+		ret = eaio_context_start(&ctx, opt_executor, (opt_executor <= 64) ? opt_cpus : NULL);
+	} else {
+		ret = pthread_create(&tid, NULL, aio_manager, &ctx);
+	}
 	assert(ret == 0);
 
 	//start_poll(&ctx, STDIN_FILENO, POLLIN | POLLHUP | POLLERR);
 
-	uint64_t beg = clock_get_abso_time();
+	struct eaio_ra *ra = NULL;
+	if (opt_readahead) {
+		ra = eaio_ra_create(&ctx, NULL);
+		assert(ra);
+	}
+	struct eaio_cache *cache = NULL;
+	if (opt_cache) {
+		struct eaio_cache_attr cattr = {
+			.capacity = opt_cache,
+		};
+		cache = eaio_cache_create(&ctx, &cattr);
+		if (!cache) {
+			fprintf(stderr, "test: Unable to create the cache: %s.\n", strerror(errno));
+			return -1;
+		}
+	}
+	/*last, so it sits on top*/
+	struct eaio_wb *wb = NULL;
+	if (opt_writeback) {
+		struct eaio_wb_attr wattr = {
+			.capacity = opt_writeback,
+		};
+		wb = eaio_wb_create(&ctx, &wattr);
+		if (!wb) {
+			fprintf(stderr, "test: Unable to create the write-back: %s.\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	if (opt_bench) {
+		go_bench(&ctx);
+	} else {
+		uint64_t beg = clock_get_abso_time();
+
+		go_test(&ctx);
 
-	go_test(&ctx);
+		uint64_t end = clock_get_abso_time();
+		printf("Use %ld\n", end - beg);
+	}
+
+	if (opt_stats) {
+		struct eaio_qstats *stats = malloc(sizeof(*stats));
+		assert(stats);
+		for (int i = 0; i < ctx.qcnts; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "queue%d", i);
+			eaio_context_stats(&ctx, i, stats);
+			eaio_qstats_print(stdout, name, stats);
+		}
+		free(stats);
+	}
 
-	uint64_t end = clock_get_abso_time();
-	printf("Use %ld\n", end - beg);
+	if (wb) {
+		struct eaio_wb_stats stats;
+		eaio_wb_stats(wb, &stats);
+		printf("writeback: absorbed %lu, passed %lu, rmw %lu, flushes %lu, flushed %lu, read hits %lu\n",
+			stats.absorbed, stats.passed, stats.rmw, stats.flushes, stats.flushed, stats.read_hits);
+		eaio_wb_destroy(wb);
+	}
+
+	if (cache) {
+		struct eaio_cache_stats stats;
+		eaio_cache_stats(cache, &stats);
+		printf("cache: hits %lu, misses %lu, bypass %lu, fills %lu, evictions %lu\n",
+			stats.hits, stats.misses, stats.bypass, stats.fills, stats.evictions);
+		eaio_cache_destroy(cache);
+	}
 
-	pthread_cancel(tid);
-	pthread_join(tid, NULL);
+	if (ra) {
+		struct eaio_ra_stats stats;
+		eaio_ra_stats(ra, &stats);
+		printf("readahead: hits %lu, misses %lu, prefetched %lu, wasted %lu\n",
+			stats.hits, stats.misses, stats.prefetched, stats.wasted);
+		eaio_ra_destroy(ra);
+	}
+
+	if (opt_trace) {
+		size_t len = strlen(opt_trace);
+		bool json = (len > 5) && (strcmp(opt_trace + len - 5, ".json") == 0);
+		FILE *fp = fopen(opt_trace, "w");
+		if (fp) {
+			if (json) {
+				fprintf(fp, "{\n");
+			}
+			for (int i = 0; i < ctx.qcnts; i++) {
+				if (json) {
+					fprintf(fp, "%s\"queue%d\": ", i ? "," : "", i);
+				} else {
+					fprintf(fp, "# queue%d\n", i);
+				}
+				eaio_context_trace_dump(&ctx, i, fp, json ? EAIO_TRACE_JSON : EAIO_TRACE_TEXT);
+			}
+			if (json) {
+				fprintf(fp, "}\n");
+			}
+			fclose(fp);
+		} else {
+			fprintf(stderr, "test: Unable to open file \"%s\": %s.\n", opt_trace, strerror(errno));
+		}
+	}
+
+	if (opt_executor > 0) {
+		eaio_context_stop(&ctx);
+	} else {
+		pthread_cancel(tid);
+		pthread_join(tid, NULL);
+	}
 
 	ret = eaio_context_exit(&ctx);
 	assert(ret == 0);